@@ -17,12 +17,29 @@
  */
 
 #include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <csignal>
 #include <cstdlib>
+#include <cstring>
+#include <deque>
 #include <functional>
 #include <map>
+#include <memory>
 #include <vector>
 #include <string>
 
+#include <execinfo.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <spawn.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <glib-unix.h>
 #include <gtk/gtk.h>
 #include <vte/vte.h>
 
@@ -62,6 +79,161 @@ static const std::vector<double> zoom_factors = {
     TERMINAL_SCALE_MAXIMUM
 };
 
+enum class trigger_action {
+    urgent,
+    notify,
+    command
+};
+
+struct trigger {
+    std::string name;
+    std::string literal; // the pattern, or a literal every regex match contains, maybe empty
+    size_t rare;         // offset of the literal's least common byte
+    GRegex *regex;
+    trigger_action action;
+    std::string command;
+};
+
+struct trigger_set {
+    std::vector<trigger> triggers;
+
+    ~trigger_set() {
+        for (const trigger &t : triggers) {
+            if (t.regex)
+                g_regex_unref(t.regex);
+        }
+    }
+};
+
+enum class key_action : uint8_t {
+    none,
+    feed,
+    fullscreen,
+    increase_font_scale,
+    decrease_font_scale,
+    reset_font_scale,
+    next_font,
+    copy_clipboard,
+    paste_clipboard,
+    reload_config,
+    new_tab,
+    next_tab,
+    previous_tab,
+    split_horizontal,
+    split_vertical,
+    next_pane,
+    previous_pane,
+    next_theme,
+    export_scrollback,
+    export_scrollback_ansi,
+    previous_prompt,
+    next_prompt,
+    copy_last_output
+};
+
+static constexpr unsigned KEY_CONTROL = 1 << 0;
+static constexpr unsigned KEY_SHIFT   = 1 << 1;
+static constexpr unsigned KEY_ALT     = 1 << 2;
+static constexpr unsigned KEY_SUPER   = 1 << 3;
+static constexpr unsigned KEY_ANY     = 1 << 4; // bound under every modifier combination
+
+struct key_binding {
+    unsigned modifiers;
+    guint keyval;
+    key_action action;
+};
+
+static constexpr key_binding default_bindings[] = {
+    { KEY_ANY,                GDK_KEY_F11,        key_action::fullscreen          },
+    { KEY_CONTROL|KEY_SHIFT,  GDK_KEY_plus,       key_action::increase_font_scale },
+    { KEY_CONTROL|KEY_SHIFT,  GDK_KEY_underscore, key_action::next_font           },
+    { KEY_CONTROL|KEY_SHIFT,  GDK_KEY_c,          key_action::copy_clipboard      },
+    { KEY_CONTROL|KEY_SHIFT,  GDK_KEY_v,          key_action::paste_clipboard     },
+    { KEY_CONTROL|KEY_SHIFT,  GDK_KEY_r,          key_action::reload_config       },
+    { KEY_CONTROL,            GDK_KEY_minus,      key_action::decrease_font_scale },
+    { KEY_CONTROL,            GDK_KEY_equal,      key_action::reset_font_scale    },
+    { KEY_CONTROL|KEY_SHIFT,  GDK_KEY_t,          key_action::new_tab             },
+    { KEY_CONTROL,            GDK_KEY_Page_Down,  key_action::next_tab            },
+    { KEY_CONTROL,            GDK_KEY_Page_Up,    key_action::previous_tab        },
+    { KEY_CONTROL|KEY_SHIFT,  GDK_KEY_e,          key_action::split_horizontal    },
+    { KEY_CONTROL|KEY_SHIFT,  GDK_KEY_o,          key_action::split_vertical      },
+    { KEY_CONTROL|KEY_SHIFT,  GDK_KEY_Right,      key_action::next_pane           },
+    { KEY_CONTROL|KEY_SHIFT,  GDK_KEY_Left,       key_action::previous_pane       },
+    { KEY_CONTROL|KEY_SHIFT,  GDK_KEY_n,          key_action::next_theme          },
+    { KEY_CONTROL|KEY_SHIFT,  GDK_KEY_s,          key_action::export_scrollback   },
+    { KEY_CONTROL|KEY_SHIFT,  GDK_KEY_Up,         key_action::previous_prompt     },
+    { KEY_CONTROL|KEY_SHIFT,  GDK_KEY_Down,       key_action::next_prompt         },
+    { KEY_CONTROL|KEY_SHIFT,  GDK_KEY_x,          key_action::copy_last_output    },
+};
+
+struct modify_key {
+    guint keyval;
+    const char *control; // sent for Ctrl and Ctrl+Shift
+    const char *meta;    // sent for Ctrl+Alt and Ctrl+Alt+Shift
+};
+
+static constexpr modify_key modify_keys[] = {
+    { GDK_KEY_Tab,        "\033[27;5;9~",  "\033[27;13;9~"  },
+    { GDK_KEY_Return,     "\033[27;5;13~", "\033[27;13;13~" },
+    { GDK_KEY_apostrophe, "\033[27;5;39~", "\033[27;13;39~" },
+    { GDK_KEY_comma,      "\033[27;5;44~", "\033[27;13;44~" },
+    { GDK_KEY_minus,      "\033[27;5;45~", "\033[27;13;45~" },
+    { GDK_KEY_period,     "\033[27;5;46~", "\033[27;13;46~" },
+    { GDK_KEY_0,          "\033[27;5;48~", "\033[27;13;48~" },
+    { GDK_KEY_1,          "\033[27;5;49~", "\033[27;13;49~" },
+    { GDK_KEY_9,          "\033[27;5;57~", "\033[27;13;57~" },
+    { GDK_KEY_semicolon,  "\033[27;5;59~", "\033[27;13;59~" },
+    { GDK_KEY_equal,      "\033[27;5;61~", "\033[27;13;61~" },
+    { GDK_KEY_exclam,     "\033[27;6;33~", "\033[27;14;33~" },
+    { GDK_KEY_quotedbl,   "\033[27;6;34~", "\033[27;14;34~" },
+    { GDK_KEY_numbersign, "\033[27;6;35~", "\033[27;14;35~" },
+    { GDK_KEY_dollar,     "\033[27;6;36~", "\033[27;14;36~" },
+    { GDK_KEY_percent,    "\033[27;6;37~", "\033[27;14;37~" },
+    { GDK_KEY_ampersand,  "\033[27;6;38~", "\033[27;14;38~" },
+    { GDK_KEY_parenleft,  "\033[27;6;40~", "\033[27;14;40~" },
+    { GDK_KEY_parenright, "\033[27;6;41~", "\033[27;14;41~" },
+    { GDK_KEY_asterisk,   "\033[27;6;42~", "\033[27;14;42~" },
+    { GDK_KEY_plus,       "\033[27;6;43~", "\033[27;14;43~" },
+    { GDK_KEY_colon,      "\033[27;6;58~", "\033[27;14;58~" },
+    { GDK_KEY_less,       "\033[27;6;60~", "\033[27;14;60~" },
+    { GDK_KEY_greater,    "\033[27;6;62~", "\033[27;14;62~" },
+    { GDK_KEY_question,   "\033[27;6;63~", "\033[27;14;63~" },
+};
+
+/*
+ * Bindings are compiled into a flat table indexed by modifier combination and key, so a key
+ * press is a single lookup. Latin-1 keysyms map to slots 0x000-0x0ff and the 0xffxx function
+ * keys to 0x100-0x1ff; other keysyms can't be bound.
+ */
+static const size_t key_slots = 0x200;
+static const size_t key_modifier_combinations = 16;
+
+struct key_entry {
+    key_action action;
+    std::string feed;
+};
+
+struct key_table {
+    std::vector<uint16_t> slots;   // index into entries, 0 when unbound
+    std::vector<key_entry> entries;
+};
+
+struct terminal_options {
+    gboolean scroll_on_output, scroll_on_keystroke, audible_bell, mouse_autohide, allow_bold;
+    gboolean search_wrap;
+    maybe<long> scrollback_lines;
+    maybe<VteCursorBlinkMode> cursor_blink;
+    maybe<VteCursorShape> cursor_shape;
+};
+
+// Parsed once per config load, so switching themes is a single palette apply
+struct color_theme {
+    std::string name;
+    maybe<GdkRGBA> foreground, foreground_bold, background, cursor, cursor_foreground, highlight;
+    std::vector<GdkRGBA> palette;  // empty to keep the VTE default palette
+    GtkCssProvider *provider;      // window background, null without a background color
+};
+
 struct config_info {
     gboolean dynamic_title, urgent_on_bell, size_hints;
     gboolean modify_other_keys;
@@ -70,117 +242,144 @@ struct config_info {
     gdouble font_scale;
     std::vector<PangoFontDescription *> fonts;
     long unsigned int current_font;
+    std::shared_ptr<const trigger_set> triggers;
+    key_table keys;
+    maybe<terminal_options> options; // applied to every terminal, unset without a config file
+    std::vector<color_theme> themes;
+    size_t current_theme;
+    std::string export_directory;
+    int resize_interval;
+    int stall_threshold;
+    gboolean stall_backtrace;
 };
 
+static const int default_resize_interval = 100; // milliseconds
+
 struct keybind_info {
     GtkWindow *window;
-    VteTerminal *vte;
+    GtkNotebook *notebook;
+    VteTerminal *vte; // the terminal with focus
     config_info config;
     std::function<void (GtkWindow *)> fullscreen_toggle;
+    gboolean hold, fixed_title;
+    char *shell;  // started in new tabs and splits
+    char **env;
 };
 
-static void window_title_cb(VteTerminal *vte, gboolean *dynamic_title);
+static void window_title_cb(VteTerminal *vte, keybind_info *info);
 static gboolean window_state_cb(GtkWindow *window, GdkEventWindowState *event, keybind_info *info);
 static gboolean key_press_cb(VteTerminal *vte, GdkEventKey *event, keybind_info *info);
 static void bell_cb(GtkWidget *vte, gboolean *urgent_on_bell);
 static gboolean focus_cb(GtkWindow *window);
 
 static void get_vte_padding(VteTerminal *vte, int *left, int *top, int *right, int *bottom);
-static void load_config(GtkWindow *window, VteTerminal *vte, config_info *info,
-                        char **geometry, char **icon);
-static void set_config(GtkWindow *window, VteTerminal *vte, config_info *info,
-                        char **geometry, char **icon, GKeyFile *config);
+static void load_config(config_info *info, char **geometry, char **icon);
+static void set_config(config_info *info, char **geometry, char **icon, GKeyFile *config);
+static void apply_config(keybind_info *info);
+static void watch_stalls(const config_info &config);
+static gboolean spawn_command(char **argv, char **env, GError **error);
+
+static std::vector<VteTerminal *> get_terminals(GtkWidget *widget);
+static GtkWidget *page_widget(keybind_info *info, GtkWidget *widget);
+static void update_size_hints(keybind_info *info);
+static void new_tab(keybind_info *info);
+static void split_terminal(keybind_info *info, GtkOrientation orientation);
+static gboolean switch_pane(keybind_info *info, int offset);
+static gboolean next_theme(keybind_info *info);
+static void export_scrollback(keybind_info *info, bool attributes);
+static gboolean jump_prompt(VteTerminal *vte, int direction);
+static gboolean copy_last_output(VteTerminal *vte);
 
 static std::function<void ()> reload_config;
 
-static void override_background_color(GtkWidget *widget, GdkRGBA *rgba) {
-    GtkCssProvider *provider = gtk_css_provider_new();
+// What the main loop is busy with, for the stall watchdog. Restored when the scope ends.
+static std::atomic<const char *> current_phase{nullptr};
+
+struct phase_scope {
+    const char *previous;
+    explicit phase_scope(const char *name)
+        : previous(current_phase.exchange(name, std::memory_order_relaxed)) {}
+    ~phase_scope() { current_phase.store(previous, std::memory_order_relaxed); }
+};
+
+// Shared by every widget in the window, so the CSS is only parsed once per config load
+static GtkCssProvider *background_provider; // the current theme's, attached to the window
+static GtkCssProvider *transparent_provider;
 
+static void load_background_color(GtkCssProvider *provider, const GdkRGBA *rgba) {
     gchar *colorstr = gdk_rgba_to_string(rgba);
     char *css = g_strdup_printf("* { background-color: %s; }", colorstr);
     gtk_css_provider_load_from_data(provider, css, -1, nullptr);
     g_free(colorstr);
     g_free(css);
+}
 
+static void add_css_provider(GtkWidget *widget, GtkCssProvider *provider) {
     gtk_style_context_add_provider(gtk_widget_get_style_context(widget),
                                    GTK_STYLE_PROVIDER(provider),
                                    GTK_STYLE_PROVIDER_PRIORITY_APPLICATION);
-    g_object_unref(provider);
-}
-
-static const std::map<int, const char *> modify_table = {
-    { GDK_KEY_Tab,        "\033[27;5;9~"  },
-    { GDK_KEY_Return,     "\033[27;5;13~" },
-    { GDK_KEY_apostrophe, "\033[27;5;39~" },
-    { GDK_KEY_comma,      "\033[27;5;44~" },
-    { GDK_KEY_minus,      "\033[27;5;45~" },
-    { GDK_KEY_period,     "\033[27;5;46~" },
-    { GDK_KEY_0,          "\033[27;5;48~" },
-    { GDK_KEY_1,          "\033[27;5;49~" },
-    { GDK_KEY_9,          "\033[27;5;57~" },
-    { GDK_KEY_semicolon,  "\033[27;5;59~" },
-    { GDK_KEY_equal,      "\033[27;5;61~" },
-    { GDK_KEY_exclam,     "\033[27;6;33~" },
-    { GDK_KEY_quotedbl,   "\033[27;6;34~" },
-    { GDK_KEY_numbersign, "\033[27;6;35~" },
-    { GDK_KEY_dollar,     "\033[27;6;36~" },
-    { GDK_KEY_percent,    "\033[27;6;37~" },
-    { GDK_KEY_ampersand,  "\033[27;6;38~" },
-    { GDK_KEY_parenleft,  "\033[27;6;40~" },
-    { GDK_KEY_parenright, "\033[27;6;41~" },
-    { GDK_KEY_asterisk,   "\033[27;6;42~" },
-    { GDK_KEY_plus,       "\033[27;6;43~" },
-    { GDK_KEY_colon,      "\033[27;6;58~" },
-    { GDK_KEY_less,       "\033[27;6;60~" },
-    { GDK_KEY_greater,    "\033[27;6;62~" },
-    { GDK_KEY_question,   "\033[27;6;63~" },
-};
-
-static const std::map<int, const char *> modify_meta_table = {
-    { GDK_KEY_Tab,        "\033[27;13;9~"  },
-    { GDK_KEY_Return,     "\033[27;13;13~" },
-    { GDK_KEY_apostrophe, "\033[27;13;39~" },
-    { GDK_KEY_comma,      "\033[27;13;44~" },
-    { GDK_KEY_minus,      "\033[27;13;45~" },
-    { GDK_KEY_period,     "\033[27;13;46~" },
-    { GDK_KEY_0,          "\033[27;13;48~" },
-    { GDK_KEY_1,          "\033[27;13;49~" },
-    { GDK_KEY_9,          "\033[27;13;57~" },
-    { GDK_KEY_semicolon,  "\033[27;13;59~" },
-    { GDK_KEY_equal,      "\033[27;13;61~" },
-    { GDK_KEY_exclam,     "\033[27;14;33~" },
-    { GDK_KEY_quotedbl,   "\033[27;14;34~" },
-    { GDK_KEY_numbersign, "\033[27;14;35~" },
-    { GDK_KEY_dollar,     "\033[27;14;36~" },
-    { GDK_KEY_percent,    "\033[27;14;37~" },
-    { GDK_KEY_ampersand,  "\033[27;14;38~" },
-    { GDK_KEY_parenleft,  "\033[27;14;40~" },
-    { GDK_KEY_parenright, "\033[27;14;41~" },
-    { GDK_KEY_asterisk,   "\033[27;14;42~" },
-    { GDK_KEY_plus,       "\033[27;14;43~" },
-    { GDK_KEY_colon,      "\033[27;14;58~" },
-    { GDK_KEY_less,       "\033[27;14;60~" },
-    { GDK_KEY_greater,    "\033[27;14;62~" },
-    { GDK_KEY_question,   "\033[27;14;63~" },
-};
+}
 
-static gboolean modify_key_feed(GdkEventKey *event, keybind_info *info,
-                                const std::map<int, const char *>& table) {
-    if (info->config.modify_other_keys) {
-        unsigned int keyval = gdk_keyval_to_lower(event->keyval);
-        auto entry = table.find((int)keyval);
+static size_t key_slot(guint keyval) {
+    if (keyval < 0x100)
+        return keyval;
+    if ((keyval & ~0xffu) == 0xff00)
+        return 0x100 | (keyval & 0xff);
+    return key_slots;
+}
 
-        if (entry != table.end()) {
-            vte_terminal_feed_child(info->vte, entry->second, -1);
-            return TRUE;
-        }
-    }
-    return FALSE;
+static const key_entry *lookup_key(const key_table &table, GdkEventKey *event) {
+    const guint state = event->state & gtk_accelerator_get_default_mod_mask();
+    const size_t slot = key_slot(gdk_keyval_to_lower(event->keyval));
+    if (slot == key_slots || table.slots.empty())
+        return nullptr;
+
+    const size_t modifiers = (state & GDK_CONTROL_MASK ? KEY_CONTROL : 0) |
+                             (state & GDK_SHIFT_MASK ? KEY_SHIFT : 0) |
+                             (state & GDK_MOD1_MASK ? KEY_ALT : 0) |
+                             (state & GDK_SUPER_MASK ? KEY_SUPER : 0);
+    const uint16_t index = table.slots[modifiers * key_slots + slot];
+    return index ? &table.entries[index] : nullptr;
 }
 
-static void set_size_hints(GtkWindow *window, VteTerminal *vte) {
-    static const GdkWindowHints wh = (GdkWindowHints)(GDK_HINT_RESIZE_INC | GDK_HINT_MIN_SIZE |
-                                                      GDK_HINT_BASE_SIZE);
+static struct {
+    uint64_t presses, bound, lookup_us; // key actions themselves aren't timed
+} key_stats;
+
+/* {{{ WINDOW UPDATES */
+/*
+ * Title, urgency and size hint changes each cost a round trip to the X server and window
+ * manager. Only the latest requested value is kept and written once per frame clock tick, or
+ * from a backstop timeout in case the frame clock is stalled (e.g. while the window is hidden).
+ * Writes that would not change anything are skipped, except urgency: window managers clear it on
+ * their own, so every new urgent request is written even when it was the last value written.
+ */
+static const guint window_update_backstop = 100;
+
+struct window_update_stats {
+    uint64_t requested, coalesced, unchanged, written;
+};
+
+static struct {
+    GtkWindow *window;
+    guint tick, timeout;
+    bool title_pending, urgency_pending;
+    std::string title;
+    bool urgency;
+    VteTerminal *hints_vte; // referenced while pending
+    bool hints_increments;
+    maybe<std::string> written_title;
+    bool written_urgency;
+    bool hints_written, written_increments;
+    GdkGeometry written_hints;
+    window_update_stats title_stats, urgency_stats, hints_stats;
+} window_updates;
+
+// Without increments only the minimum size is set, for when tabs or splits add chrome
+static void write_size_hints(GtkWindow *window, VteTerminal *vte, bool increments) {
+    const GdkWindowHints wh = increments
+        ? (GdkWindowHints)(GDK_HINT_RESIZE_INC | GDK_HINT_MIN_SIZE | GDK_HINT_BASE_SIZE)
+        : GDK_HINT_MIN_SIZE;
     const int char_width = (int)vte_terminal_get_char_width(vte);
     const int char_height = (int)vte_terminal_get_char_height(vte);
     int padding_left, padding_top, padding_right, padding_bottom;
@@ -194,314 +393,2334 @@ static void set_size_hints(GtkWindow *window, VteTerminal *vte) {
     hints.width_inc  = char_width;
     hints.height_inc = char_height;
 
+    const GdkGeometry &last = window_updates.written_hints;
+    if (window_updates.hints_written && window_updates.written_increments == increments &&
+        last.base_width == hints.base_width &&
+        last.base_height == hints.base_height && last.width_inc == hints.width_inc &&
+        last.height_inc == hints.height_inc) {
+        window_updates.hints_stats.unchanged++;
+        return;
+    }
     gtk_window_set_geometry_hints(GTK_WINDOW(window), NULL, &hints, wh);
+    window_updates.written_hints = hints;
+    window_updates.written_increments = increments;
+    window_updates.hints_written = true;
+    window_updates.hints_stats.written++;
+}
+
+static void flush_window_updates() {
+    phase_scope phase("window updates");
+    auto &u = window_updates;
+    if (u.tick) {
+        gtk_widget_remove_tick_callback(GTK_WIDGET(u.window), u.tick);
+        u.tick = 0;
+    }
+    if (u.timeout) {
+        g_source_remove(u.timeout);
+        u.timeout = 0;
+    }
+
+    if (u.title_pending) {
+        u.title_pending = false;
+        if (u.written_title && *u.written_title == u.title) {
+            u.title_stats.unchanged++;
+        } else {
+            gtk_window_set_title(u.window, u.title.c_str());
+            u.written_title = std::string(u.title);
+            u.title_stats.written++;
+        }
+    }
+    if (u.urgency_pending) {
+        u.urgency_pending = false;
+        GdkWindow *window = gtk_widget_get_window(GTK_WIDGET(u.window));
+        if (!u.urgency && !u.written_urgency) {
+            u.urgency_stats.unchanged++;
+        } else if (u.urgency && u.written_urgency && window) {
+            // GTK would skip this as unchanged, the window manager may have cleared it since
+            gdk_window_set_urgency_hint(window, TRUE);
+            u.urgency_stats.written++;
+        } else {
+            gtk_window_set_urgency_hint(u.window, u.urgency);
+            u.written_urgency = u.urgency;
+            u.urgency_stats.written++;
+        }
+    }
+    if (u.hints_vte) {
+        write_size_hints(u.window, u.hints_vte, u.hints_increments);
+        g_object_unref(u.hints_vte);
+        u.hints_vte = nullptr;
+    }
 }
 
+static gboolean window_updates_tick_cb(GtkWidget *, GdkFrameClock *, gpointer) {
+    window_updates.tick = 0;
+    flush_window_updates();
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean window_updates_timeout_cb(gpointer) {
+    window_updates.timeout = 0;
+    flush_window_updates();
+    return G_SOURCE_REMOVE;
+}
+
+static void schedule_window_updates(GtkWindow *window) {
+    auto &u = window_updates;
+    u.window = window;
+    if (!u.tick) {
+        u.tick = gtk_widget_add_tick_callback(GTK_WIDGET(window), window_updates_tick_cb,
+                                              nullptr, nullptr);
+    }
+    if (!u.timeout) {
+        u.timeout = g_timeout_add(window_update_backstop, window_updates_timeout_cb, nullptr);
+    }
+}
+
+static void set_window_title(GtkWindow *window, const char *title) {
+    auto &u = window_updates;
+    u.title_stats.requested++;
+    u.title_stats.coalesced += u.title_pending;
+    if (!u.title_pending && u.written_title && *u.written_title == title) {
+        u.title_stats.unchanged++;
+        return;
+    }
+    u.title = title;
+    u.title_pending = true;
+    schedule_window_updates(window);
+}
+
+static void set_urgency_hint(GtkWindow *window, bool urgency) {
+    auto &u = window_updates;
+    u.urgency_stats.requested++;
+    u.urgency_stats.coalesced += u.urgency_pending;
+    if (!u.urgency_pending && !urgency && !u.written_urgency) {
+        u.urgency_stats.unchanged++;
+        return;
+    }
+    u.urgency = urgency;
+    u.urgency_pending = true;
+    schedule_window_updates(window);
+}
+
+static void set_size_hints(GtkWindow *window, VteTerminal *vte, bool increments) {
+    auto &u = window_updates;
+    u.hints_stats.requested++;
+    if (u.hints_vte) {
+        u.hints_stats.coalesced++;
+        g_object_unref(u.hints_vte);
+    }
+    u.hints_vte = VTE_TERMINAL(g_object_ref(vte));
+    u.hints_increments = increments;
+    schedule_window_updates(window);
+}
+/* }}} */
+
 /* {{{ CALLBACKS */
-void window_title_cb(VteTerminal *vte, gboolean *dynamic_title) {
-    const char *const title = *dynamic_title ? vte_terminal_get_window_title(vte) : nullptr;
-    gtk_window_set_title(GTK_WINDOW(gtk_widget_get_toplevel(GTK_WIDGET(vte))),
-                         title ? title : "termite");
+void window_title_cb(VteTerminal *vte, keybind_info *info) {
+    phase_scope phase("window title");
+    const char *const title = info->config.dynamic_title ? vte_terminal_get_window_title(vte) : nullptr;
+    if (GtkWidget *page = page_widget(info, GTK_WIDGET(vte))) {
+        gtk_notebook_set_tab_label_text(info->notebook, page, title ? title : "termite");
+    }
+    if (vte == info->vte) {
+        set_window_title(info->window, title ? title : "termite");
+    }
 }
 
 static void reset_font_scale(VteTerminal *vte, gdouble scale) {
     vte_terminal_set_font_scale(vte, scale);
 }
 
-static void increase_font_scale(VteTerminal *vte) {
-    gdouble scale = vte_terminal_get_font_scale(vte);
+static void increase_font_scale(VteTerminal *vte) {
+    gdouble scale = vte_terminal_get_font_scale(vte);
+
+    for (auto it = zoom_factors.begin(); it != zoom_factors.end(); ++it) {
+        if ((*it - scale) > 1e-6) {
+            vte_terminal_set_font_scale(vte, *it);
+            return;
+        }
+    }
+}
+
+static void decrease_font_scale(VteTerminal *vte) {
+    gdouble scale = vte_terminal_get_font_scale(vte);
+
+    for (auto it = zoom_factors.rbegin(); it != zoom_factors.rend(); ++it) {
+        if ((scale - *it) > 1e-6) {
+            vte_terminal_set_font_scale(vte, *it);
+            return;
+        }
+    }
+}
+
+gboolean window_state_cb(GtkWindow *, GdkEventWindowState *event, keybind_info *info) {
+    if (event->new_window_state & GDK_WINDOW_STATE_FULLSCREEN)
+        info->fullscreen_toggle = gtk_window_unfullscreen;
+    else
+        info->fullscreen_toggle = gtk_window_fullscreen;
+    return FALSE;
+}
+
+static gboolean run_key_action(VteTerminal *vte, const key_entry &entry, keybind_info *info) {
+    switch (entry.action) {
+        case key_action::none:
+            return FALSE;
+        case key_action::feed:
+            vte_terminal_feed_child(vte, entry.feed.data(), (glong)entry.feed.size());
+            return TRUE;
+        case key_action::fullscreen:
+            if (!info->config.fullscreen)
+                return FALSE;
+            info->fullscreen_toggle(info->window);
+            return TRUE;
+        case key_action::increase_font_scale:
+            increase_font_scale(vte);
+            return TRUE;
+        case key_action::decrease_font_scale:
+            decrease_font_scale(vte);
+            return TRUE;
+        case key_action::reset_font_scale:
+            reset_font_scale(vte, info->config.font_scale);
+            return TRUE;
+        case key_action::next_font:
+            if (info->config.fonts.empty())
+                return FALSE;
+            info->config.current_font++;
+            info->config.current_font %= info->config.fonts.size();
+            for (VteTerminal *terminal : get_terminals(GTK_WIDGET(info->notebook))) {
+                vte_terminal_set_font(terminal, info->config.fonts[info->config.current_font]);
+            }
+            return TRUE;
+        case key_action::copy_clipboard: {
+            phase_scope phase("copy");
+            vte_terminal_copy_clipboard(vte);
+            return TRUE;
+        }
+        case key_action::paste_clipboard: {
+            phase_scope phase("paste");
+            vte_terminal_paste_clipboard(vte);
+            return TRUE;
+        }
+        case key_action::reload_config:
+            reload_config();
+            return TRUE;
+        case key_action::new_tab:
+            new_tab(info);
+            return TRUE;
+        case key_action::next_tab:
+        case key_action::previous_tab:
+            // with a single tab the key goes to the child, e.g. for tabs in vim
+            if (gtk_notebook_get_n_pages(info->notebook) < 2)
+                return FALSE;
+            if (entry.action == key_action::next_tab)
+                gtk_notebook_next_page(info->notebook);
+            else
+                gtk_notebook_prev_page(info->notebook);
+            return TRUE;
+        case key_action::split_horizontal:
+            split_terminal(info, GTK_ORIENTATION_HORIZONTAL);
+            return TRUE;
+        case key_action::split_vertical:
+            split_terminal(info, GTK_ORIENTATION_VERTICAL);
+            return TRUE;
+        case key_action::next_pane:
+            return switch_pane(info, 1);
+        case key_action::previous_pane:
+            return switch_pane(info, -1);
+        case key_action::next_theme:
+            return next_theme(info);
+        case key_action::export_scrollback:
+            export_scrollback(info, false);
+            return TRUE;
+        case key_action::export_scrollback_ansi:
+            export_scrollback(info, true);
+            return TRUE;
+        case key_action::previous_prompt:
+            return jump_prompt(vte, -1);
+        case key_action::next_prompt:
+            return jump_prompt(vte, 1);
+        case key_action::copy_last_output:
+            return copy_last_output(vte);
+    }
+    return FALSE;
+}
+
+gboolean key_press_cb(VteTerminal *vte, GdkEventKey *event, keybind_info *info) {
+    phase_scope phase("key press");
+    const gint64 start = g_get_monotonic_time();
+    const key_entry *entry = lookup_key(info->config.keys, event);
+    key_stats.lookup_us += uint64_t(g_get_monotonic_time() - start);
+
+    const gboolean handled = entry && run_key_action(vte, *entry, info);
+    key_stats.presses++;
+    key_stats.bound += handled;
+    return handled;
+}
+
+static void bell_cb(GtkWidget *vte, gboolean *urgent_on_bell) {
+    if (*urgent_on_bell) {
+        set_urgency_hint(GTK_WINDOW(gtk_widget_get_toplevel(vte)), true);
+    }
+}
+
+gboolean focus_cb(GtkWindow *window) {
+    set_urgency_hint(window, false);
+    return FALSE;
+}
+/* }}} */
+
+/* {{{ TRIGGERS */
+/*
+ * Child output is sampled from the terminal on the main thread at most every
+ * trigger_scan_interval ms and matched on a worker thread. Each scan starts at the row the last
+ * one ended on, so a partial line is matched again once more output arrives on it. At most
+ * trigger_scan_chunk_rows are fetched at once to keep the main thread responsive, and when
+ * behind the next chunk follows from a low priority idle. Rows trimmed from the scrollback
+ * before they were reached are skipped.
+ */
+static const guint trigger_scan_interval = 50;
+static const long trigger_scan_chunk_rows = 1000;
+static const gint64 trigger_cooldown = G_USEC_PER_SEC; // for notifications and commands
+
+struct trigger_state {
+    keybind_info *info;
+    std::shared_ptr<const trigger_set> triggers;
+    std::vector<bool> partial_fired; // triggers already fired for the line the scan starts on
+    std::vector<gint64> last_fired;
+    long scanned_row;
+    guint timeout;
+    bool scanning, dirty, behind;
+};
+
+struct trigger_match {
+    size_t index;
+    size_t line;
+    std::string text;
+};
+
+struct trigger_job {
+    VteTerminal *vte;
+    std::shared_ptr<const trigger_set> triggers;
+    std::string text;
+    size_t lines;
+    std::vector<trigger_match> matches;
+};
+
+static struct {
+    std::atomic<uint64_t> scans, bytes, matches, busy_us, rows_skipped, suppressed;
+} trigger_stats;
+
+static GThreadPool *trigger_pool;
+
+static gboolean trigger_scan_done(gpointer data);
+static gboolean trigger_timeout_cb(gpointer data);
+
+static void trigger_scan(gpointer data, gpointer) {
+    trigger_job *job = static_cast<trigger_job *>(data);
+    const gint64 start = g_get_monotonic_time();
+    const char *const text = job->text.data();
+    const size_t size = job->text.size();
+    const std::vector<trigger> &triggers = job->triggers->triggers;
+
+    std::vector<size_t> line_starts{0};
+    for (const void *p = text; (p = memchr(p, '\n', size_t(text + size - (const char *)p)));) {
+        p = (const char *)p + 1;
+        if (p == text + size)
+            break;
+        line_starts.push_back(size_t((const char *)p - text));
+    }
+    job->lines = line_starts.size();
+
+    // Report the whole line a match is on and resume after it, one hit per line is enough
+    auto line_of = [&](size_t pos) {
+        return size_t(std::upper_bound(line_starts.begin(), line_starts.end(), pos) -
+                      line_starts.begin()) - 1;
+    };
+    auto line_end = [&](size_t line) {
+        return line + 1 < line_starts.size() ? line_starts[line + 1] - 1 : size;
+    };
+    auto add_match = [&](size_t index, size_t line, size_t end) {
+        const size_t begin = line_starts[line];
+        job->matches.push_back({index, line, std::string(text + begin, end - begin)});
+    };
+
+    for (size_t i = 0; i < triggers.size(); i++) {
+        const trigger &t = triggers[i];
+        if (t.literal.empty()) {
+            for (size_t pos = 0; pos < size;) {
+                GMatchInfo *match;
+                gint match_start, match_end;
+                const gboolean matched = g_regex_match_full(t.regex, text, gssize(size), gint(pos),
+                                                            (GRegexMatchFlags)0, &match, nullptr);
+                if (matched)
+                    g_match_info_fetch_pos(match, 0, &match_start, &match_end);
+                g_match_info_free(match);
+                if (!matched)
+                    break;
+                const size_t line = line_of(size_t(match_start));
+                const size_t end = line_end(line);
+                add_match(i, line, end);
+                pos = end + 1;
+            }
+            continue;
+        }
+
+        // memchr for the literal's least common byte skips ahead to candidates, regexes only
+        // run on lines that hold their literal
+        const size_t length = t.literal.size();
+        for (size_t pos = t.rare; pos < size;) {
+            const void *p = memchr(text + pos, t.literal[t.rare], size - pos);
+            if (!p)
+                break;
+            const size_t found = size_t(static_cast<const char *>(p) - text) - t.rare;
+            pos = found + t.rare + 1;
+            if (length > size - found || memcmp(text + found, t.literal.data(), length))
+                continue;
+
+            const size_t line = line_of(found);
+            const size_t begin = line_starts[line], end = line_end(line);
+            if (!t.regex || g_regex_match_full(t.regex, text + begin, gssize(end - begin), 0,
+                                               (GRegexMatchFlags)0, nullptr, nullptr))
+                add_match(i, line, end);
+            pos = end + 1 + t.rare;
+        }
+    }
+
+    // fire in the order the lines were printed
+    std::stable_sort(job->matches.begin(), job->matches.end(),
+                     [](const trigger_match &a, const trigger_match &b) { return a.line < b.line; });
+
+    trigger_stats.scans++;
+    trigger_stats.bytes += size;
+    trigger_stats.matches += job->matches.size();
+    trigger_stats.busy_us += uint64_t(g_get_monotonic_time() - start);
+
+    g_idle_add(trigger_scan_done, job);
+}
+
+static trigger_state *get_trigger_state(VteTerminal *vte) {
+    return static_cast<trigger_state *>(g_object_get_data(G_OBJECT(vte), "termise-triggers"));
+}
+
+static GDBusConnection *notify_bus; // kept once connected
+
+static void send_notification(const std::string &summary, const std::string &body) {
+    g_dbus_connection_call(notify_bus, "org.freedesktop.Notifications",
+                           "/org/freedesktop/Notifications", "org.freedesktop.Notifications",
+                           "Notify",
+                           g_variant_new("(susss@as@a{sv}i)", "termise", 0u, "utilities-terminal",
+                                         summary.c_str(), body.c_str(),
+                                         g_variant_new_strv(nullptr, 0),
+                                         g_variant_new_array(G_VARIANT_TYPE("{sv}"), nullptr, 0),
+                                         -1),
+                           nullptr, G_DBUS_CALL_FLAGS_NONE, -1, nullptr, nullptr, nullptr);
+}
+
+static void notify_ready(GObject *, GAsyncResult *result, gpointer data) {
+    std::unique_ptr<std::pair<std::string, std::string>> message(
+        static_cast<std::pair<std::string, std::string> *>(data));
+
+    GError *error = nullptr;
+    GDBusConnection *bus = g_bus_get_finish(result, &error);
+    if (!bus) {
+        g_printerr("failed to send notification: %s\n", error->message);
+        g_error_free(error);
+        return;
+    }
+    if (notify_bus)
+        g_object_unref(bus);
+    else
+        notify_bus = bus;
+    send_notification(message->first, message->second);
+}
+
+static void trigger_fire(VteTerminal *vte, const trigger &t, const std::string &line) {
+    GtkWidget *toplevel = gtk_widget_get_toplevel(GTK_WIDGET(vte));
+
+    switch (t.action) {
+        case trigger_action::urgent:
+            if (gtk_widget_is_toplevel(toplevel))
+                set_urgency_hint(GTK_WINDOW(toplevel), true);
+            break;
+        case trigger_action::notify:
+            if (notify_bus)
+                send_notification(t.name, line);
+            else
+                g_bus_get(G_BUS_TYPE_SESSION, nullptr, notify_ready,
+                          new std::pair<std::string, std::string>(t.name, line));
+            break;
+        case trigger_action::command: {
+            GError *error = nullptr;
+            int argcp;
+            char **argvp;
+            if (!g_shell_parse_argv(t.command.c_str(), &argcp, &argvp, &error)) {
+                g_printerr("invalid trigger command: %s\n", error->message);
+                g_error_free(error);
+                break;
+            }
+            char **env = g_get_environ();
+            env = g_environ_setenv(env, "TERMISE_TRIGGER", t.name.c_str(), TRUE);
+            env = g_environ_setenv(env, "TERMISE_TRIGGER_LINE", line.c_str(), TRUE);
+            if (!spawn_command(argvp, env, &error)) {
+                g_printerr("the trigger command failed to run: %s\n", error->message);
+                g_error_free(error);
+            }
+            g_strfreev(env);
+            g_strfreev(argvp);
+            break;
+        }
+    }
+}
+
+static gboolean trigger_scan_done(gpointer data) {
+    phase_scope phase("triggers");
+    std::unique_ptr<trigger_job> job(static_cast<trigger_job *>(data));
+    trigger_state *state = get_trigger_state(job->vte);
+    state->scanning = false;
+
+    if (state->triggers == job->triggers) {
+        // during floods each trigger fires once per scan, notifications and commands at most
+        // once per trigger_cooldown
+        const std::vector<trigger> &triggers = job->triggers->triggers;
+        const gint64 now = g_get_monotonic_time();
+        std::vector<bool> fired(triggers.size()), fired_now(triggers.size());
+        for (const trigger_match &m : job->matches) {
+            if (m.line == job->lines - 1)
+                fired[m.index] = true;
+            if (m.line == 0 && state->partial_fired[m.index])
+                continue;
+            const trigger &t = triggers[m.index];
+            if (fired_now[m.index] || (t.action != trigger_action::urgent &&
+                                       state->last_fired[m.index] &&
+                                       now - state->last_fired[m.index] < trigger_cooldown)) {
+                trigger_stats.suppressed++;
+                continue;
+            }
+            fired_now[m.index] = true;
+            state->last_fired[m.index] = now;
+            trigger_fire(job->vte, t, m.text);
+        }
+        if (job->lines == 1) {
+            for (size_t i = 0; i < fired.size(); i++)
+                fired[i] = fired[i] || state->partial_fired[i];
+        }
+        state->partial_fired = fired;
+    }
+
+    if (state->behind && !state->timeout)
+        state->timeout = g_idle_add_full(G_PRIORITY_LOW, trigger_timeout_cb,
+                                         g_object_ref(job->vte), g_object_unref);
+    else if (state->dirty && !state->timeout)
+        state->timeout = g_timeout_add_full(G_PRIORITY_DEFAULT, trigger_scan_interval,
+                                            trigger_timeout_cb, g_object_ref(job->vte),
+                                            g_object_unref);
+    g_object_unref(job->vte);
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean trigger_timeout_cb(gpointer data) {
+    VteTerminal *vte = static_cast<VteTerminal *>(data);
+    trigger_state *state = get_trigger_state(vte);
+    state->timeout = 0;
+    state->dirty = false;
+
+    const std::shared_ptr<const trigger_set> triggers = state->info->config.triggers;
+    if (!triggers || !gtk_widget_get_parent(GTK_WIDGET(vte)))
+        return G_SOURCE_REMOVE;
+
+    glong column, row;
+    vte_terminal_get_cursor_position(vte, &column, &row);
+
+    GtkAdjustment *adjustment = gtk_scrollable_get_vadjustment(GTK_SCROLLABLE(vte));
+    const long lower = (long)gtk_adjustment_get_lower(adjustment);
+
+    long first = state->scanned_row;
+    if (triggers != state->triggers || row < first) {
+        // new trigger set or the terminal was reset
+        state->triggers = triggers;
+        first = row;
+        state->partial_fired.assign(triggers->triggers.size(), false);
+        state->last_fired.assign(triggers->triggers.size(), 0);
+    } else if (first < lower) {
+        trigger_stats.rows_skipped += uint64_t(lower - first);
+        first = lower;
+        state->partial_fired.assign(triggers->triggers.size(), false);
+    }
+
+    const long last = std::min(row, first + trigger_scan_chunk_rows);
+    state->behind = last < row;
+    char *text = vte_terminal_get_text_range(vte, first, 0, last,
+                                             vte_terminal_get_column_count(vte) - 1,
+                                             nullptr, nullptr, nullptr);
+    if (!text)
+        return G_SOURCE_REMOVE;
+
+    trigger_job *job = new trigger_job{vte, triggers, text, 0, {}};
+    g_free(text);
+    state->scanned_row = last;
+    state->scanning = true;
+    g_object_ref(vte);
+    g_thread_pool_push(trigger_pool, job, nullptr);
+    return G_SOURCE_REMOVE;
+}
+
+static void contents_changed_cb(VteTerminal *vte, keybind_info *info) {
+    phase_scope phase("triggers");
+    if (!info->config.triggers)
+        return;
+
+    trigger_state *state = get_trigger_state(vte);
+    if (state->scanning || state->timeout) {
+        state->dirty = true;
+        return;
+    }
+    state->timeout = g_timeout_add_full(G_PRIORITY_DEFAULT, trigger_scan_interval,
+                                        trigger_timeout_cb, g_object_ref(vte), g_object_unref);
+}
+
+static void watch_triggers(VteTerminal *vte, keybind_info *info) {
+    if (!trigger_pool)
+        trigger_pool = g_thread_pool_new(trigger_scan, nullptr, 1, FALSE, nullptr);
+
+    trigger_state *state = new trigger_state{info, {}, {}, {}, 0, 0, false, false, false};
+    g_object_set_data_full(G_OBJECT(vte), "termise-triggers", state, [](gpointer data) {
+        delete static_cast<trigger_state *>(data);
+    });
+    g_signal_connect(vte, "contents-changed", G_CALLBACK(contents_changed_cb), info);
+}
+/* }}} */
+
+/* {{{ SCROLLBACK EXPORT */
+/*
+ * The scrollback is written out export_chunk_rows at a time. Each chunk is fetched from a low
+ * priority idle callback and written asynchronously before the next one is fetched, so memory
+ * use stays bounded and input and drawing are never held up for long.
+ */
+static const long export_chunk_rows = 1000;
+
+struct export_job {
+    VteTerminal *vte;
+    std::string base; // the path without its extension
+    int attempt;      // numbered suffixes tried after an existing file
+    GFile *file;
+    GOutputStream *stream;
+    bool attributes;
+    long row, end_row;
+    std::string chunk;
+};
+
+static gboolean export_next_chunk(gpointer data);
+
+static bool same_attributes(const VteCharAttributes &a, const VteCharAttributes &b) {
+    return a.fore.red == b.fore.red && a.fore.green == b.fore.green &&
+           a.fore.blue == b.fore.blue && a.back.red == b.back.red &&
+           a.back.green == b.back.green && a.back.blue == b.back.blue &&
+           a.underline == b.underline && a.strikethrough == b.strikethrough;
+}
+
+// VTE reports attributes per byte of text, turn changes into SGR sequences
+static void append_with_attributes(std::string *out, const char *text, GArray *attributes) {
+    const VteCharAttributes *previous = nullptr;
+    for (size_t i = 0; text[i]; i++) {
+        if (i < attributes->len) {
+            const VteCharAttributes &attr = g_array_index(attributes, VteCharAttributes, i);
+            if (!previous || !same_attributes(*previous, attr)) {
+                char sgr[64];
+                snprintf(sgr, sizeof sgr, "\033[0;38;2;%u;%u;%u;48;2;%u;%u;%u%s%sm",
+                         attr.fore.red >> 8, attr.fore.green >> 8, attr.fore.blue >> 8,
+                         attr.back.red >> 8, attr.back.green >> 8, attr.back.blue >> 8,
+                         attr.underline ? ";4" : "", attr.strikethrough ? ";9" : "");
+                *out += sgr;
+                previous = &attr;
+            }
+        }
+        *out += text[i];
+    }
+    *out += "\033[0m";
+}
+
+static void finish_export(export_job *job, GError *error) {
+    char *path = g_file_get_path(job->file);
+    if (error) {
+        g_printerr("failed to export scrollback to %s: %s\n", path, error->message);
+        g_error_free(error);
+    } else if (job->row < job->end_row) {
+        g_printerr("scrollback export to %s stopped, the terminal was closed\n", path);
+    } else {
+        g_printerr("scrollback exported to %s\n", path);
+    }
+    g_free(path);
+    if (job->stream) {
+        g_output_stream_close_async(job->stream, G_PRIORITY_LOW, nullptr, nullptr, nullptr);
+        g_object_unref(job->stream);
+    }
+    g_object_unref(job->file);
+    g_object_unref(job->vte);
+    delete job;
+}
+
+static void export_written(GObject *, GAsyncResult *result, gpointer data) {
+    export_job *job = static_cast<export_job *>(data);
+    GError *error = nullptr;
+    if (!g_output_stream_write_all_finish(job->stream, result, nullptr, &error)) {
+        finish_export(job, error);
+        return;
+    }
+    g_idle_add_full(G_PRIORITY_LOW, export_next_chunk, job, nullptr);
+}
+
+gboolean export_next_chunk(gpointer data) {
+    phase_scope phase("scrollback export");
+    export_job *job = static_cast<export_job *>(data);
+    if (job->row >= job->end_row || !gtk_widget_get_parent(GTK_WIDGET(job->vte))) {
+        finish_export(job, nullptr);
+        return G_SOURCE_REMOVE;
+    }
+
+    const long last = std::min(job->row + export_chunk_rows, job->end_row) - 1;
+    GArray *attributes = job->attributes ? g_array_new(FALSE, FALSE, sizeof(VteCharAttributes))
+                                         : nullptr;
+    char *text = vte_terminal_get_text_range(job->vte, job->row, 0, last,
+                                             vte_terminal_get_column_count(job->vte) - 1,
+                                             nullptr, nullptr, attributes);
+    job->row = last + 1;
+
+    job->chunk.clear();
+    if (text && attributes) {
+        append_with_attributes(&job->chunk, text, attributes);
+    } else if (text) {
+        job->chunk = text;
+    }
+    g_free(text);
+    if (attributes) {
+        g_array_free(attributes, TRUE);
+    }
+
+    if (job->chunk.empty()) {
+        return G_SOURCE_CONTINUE;
+    }
+    g_output_stream_write_all_async(job->stream, job->chunk.data(), job->chunk.size(),
+                                    G_PRIORITY_LOW, nullptr, export_written, job);
+    return G_SOURCE_REMOVE;
+}
+
+static void export_create(export_job *job);
+
+static void export_opened(GObject *, GAsyncResult *result, gpointer data) {
+    export_job *job = static_cast<export_job *>(data);
+    GError *error = nullptr;
+    GFileOutputStream *stream = g_file_create_finish(job->file, result, &error);
+    if (!stream && g_error_matches(error, G_IO_ERROR, G_IO_ERROR_EXISTS) && job->attempt < 100) {
+        // another export in the same second, never overwrite it
+        g_error_free(error);
+        job->attempt++;
+        export_create(job);
+        return;
+    }
+    if (!stream) {
+        finish_export(job, error);
+        return;
+    }
+    job->stream = G_OUTPUT_STREAM(stream);
+    g_idle_add_full(G_PRIORITY_LOW, export_next_chunk, job, nullptr);
+}
+
+// Creates termise-<time>.txt, or termise-<time>-<attempt>.txt after the first attempt
+static void export_create(export_job *job) {
+    std::string path = job->base;
+    if (job->attempt)
+        path += "-" + std::to_string(job->attempt);
+    path += job->attributes ? ".ansi" : ".txt";
+
+    if (job->file)
+        g_object_unref(job->file);
+    job->file = g_file_new_for_path(path.c_str());
+    g_file_create_async(job->file, G_FILE_CREATE_NONE, G_PRIORITY_LOW, nullptr, export_opened, job);
+}
+
+void export_scrollback(keybind_info *info, bool attributes) {
+    if (!info->vte)
+        return;
+
+    GDateTime *now = g_date_time_new_now_local();
+    char *name = g_date_time_format(now, "termise-%Y%m%d-%H%M%S");
+    g_date_time_unref(now);
+    const std::string &directory = info->config.export_directory;
+    char *path = g_build_filename(directory.empty() ? g_get_home_dir() : directory.c_str(),
+                                  name, nullptr);
+    g_free(name);
+
+    // rows of the whole scrollback as of now, later output isn't included
+    GtkAdjustment *adjustment = gtk_scrollable_get_vadjustment(GTK_SCROLLABLE(info->vte));
+    export_job *job = new export_job{VTE_TERMINAL(g_object_ref(info->vte)), path, 0, nullptr,
+                                     nullptr, attributes,
+                                     (long)gtk_adjustment_get_lower(adjustment),
+                                     (long)gtk_adjustment_get_upper(adjustment), {}};
+    g_free(path);
+    export_create(job);
+}
+/* }}} */
+
+void get_vte_padding(VteTerminal *vte, int *left, int *top, int *right, int *bottom) {
+    GtkBorder border;
+    gtk_style_context_get_padding(gtk_widget_get_style_context(GTK_WIDGET(vte)),
+                                  gtk_widget_get_state_flags(GTK_WIDGET(vte)),
+                                  &border);
+    *left = border.left;
+    *right = border.right;
+    *top = border.top;
+    *bottom = border.bottom;
+}
+
+/* {{{ CONFIG LOADING */
+template<typename T>
+maybe<T> get_config(T (*get)(GKeyFile *, const char *, const char *, GError **),
+                    GKeyFile *config, const char *group, const char *key) {
+    GError *error = nullptr;
+    maybe<T> value = get(config, group, key, &error);
+    if (error) {
+        g_error_free(error);
+        return {};
+    }
+    return value;
+}
+
+auto get_config_integer(std::bind(get_config<int>, g_key_file_get_integer,
+                                  _1, _2, _3));
+auto get_config_string(std::bind(get_config<char *>, g_key_file_get_string,
+                                 _1, _2, _3));
+auto get_config_double(std::bind(get_config<double>, g_key_file_get_double,
+                                 _1, _2, _3));
+
+static maybe<GdkRGBA> get_config_color(GKeyFile *config, const char *section, const char *key) {
+    if (auto s = get_config_string(config, section, key)) {
+        GdkRGBA color;
+        if (gdk_rgba_parse(&color, *s)) {
+            g_free(*s);
+            return color;
+        }
+        g_printerr("invalid color string: %s\n", *s);
+        g_free(*s);
+    }
+    return {};
+}
+
+static std::vector<PangoFontDescription *> split_fonts (char *str) {
+    std::vector<PangoFontDescription *> ret;
+    std::string s(str);
+    std::string buf = "";
+    for (unsigned int i = 0; i<s.size(); i++) {
+        if (s[i] == ',') {
+            ret.push_back(pango_font_description_from_string(buf.data()));
+            buf = "";
+        } else buf += s[i];
+    }
+    ret.push_back(pango_font_description_from_string(buf.data()));
+    return ret;
+}
+
+// Rough ranking of how common bytes are in terminal output
+static int byte_frequency(unsigned char c) {
+    if (c == ' ')
+        return 5;
+    if (c >= 'a' && c <= 'z')
+        return strchr("etaoinsrhl", c) ? 4 : 3;
+    if (c && strchr("./-_:=", c))
+        return 3;
+    if ((c >= '0' && c <= '9') || (c >= 'A' && c <= 'Z'))
+        return 2;
+    return 1;
+}
+
+// A literal that every match of a regex contains, empty if it can't be told cheaply
+static std::string regex_literal(const std::string &pattern) {
+    if (pattern.find("(?") != std::string::npos)
+        return {};
+    // alternatives outside a group may not contain the literal
+    int depth = 0;
+    bool in_class = false;
+    for (size_t i = 0; i < pattern.size(); i++) {
+        const char c = pattern[i];
+        if (c == '\\') {
+            i++;
+        } else if (in_class) {
+            in_class = c != ']';
+        } else if (c == '[') {
+            in_class = true;
+        } else if (c == '(' || c == ')') {
+            depth += c == '(' ? 1 : -1;
+        } else if (c == '|' && !depth) {
+            return {};
+        }
+    }
+
+    std::string literal;
+    size_t i = pattern[0] == '^' ? 1 : 0;
+    for (; i < pattern.size() && !strchr("\\^$.|?*+()[]{}", pattern[i]); i++)
+        literal += pattern[i];
+    // a quantifier can make the last character optional
+    if (i < pattern.size() && strchr("?*{", pattern[i]) && !literal.empty())
+        literal.pop_back();
+    return literal;
+}
+
+static std::shared_ptr<const trigger_set> load_triggers(GKeyFile *config) {
+    char **keys = g_key_file_get_keys(config, "triggers", nullptr, nullptr);
+    if (!keys)
+        return {};
+
+    std::shared_ptr<trigger_set> set = std::make_shared<trigger_set>();
+    for (char **key = keys; *key; key++) {
+        gsize length;
+        char **values = g_key_file_get_string_list(config, "triggers", *key, &length, nullptr);
+        if (!values)
+            continue;
+
+        trigger t {*key, {}, 0, nullptr, trigger_action::urgent, {}};
+        if (length >= 2 && !g_ascii_strcasecmp(values[1], "urgent")) {
+            t.action = trigger_action::urgent;
+        } else if (length >= 2 && !g_ascii_strcasecmp(values[1], "notify")) {
+            t.action = trigger_action::notify;
+        } else if (length >= 3 && !g_ascii_strcasecmp(values[1], "command")) {
+            t.action = trigger_action::command;
+            char *command = g_strjoinv(";", values + 2);
+            t.command = command;
+            g_free(command);
+        } else {
+            g_printerr("invalid trigger: %s\n", *key);
+            g_strfreev(values);
+            continue;
+        }
+
+        const size_t pattern_length = strlen(values[0]);
+        if (pattern_length > 2 && values[0][0] == '/' && values[0][pattern_length - 1] == '/') {
+            const std::string pattern(values[0] + 1, pattern_length - 2);
+            t.literal = regex_literal(pattern);
+            GError *error = nullptr;
+            t.regex = g_regex_new(pattern.c_str(),
+                                  (GRegexCompileFlags)(G_REGEX_OPTIMIZE | G_REGEX_MULTILINE),
+                                  (GRegexMatchFlags)0, &error);
+            if (!t.regex) {
+                g_printerr("invalid trigger regex: %s\n", error->message);
+                g_error_free(error);
+                g_strfreev(values);
+                continue;
+            }
+        } else if (pattern_length) {
+            t.literal = values[0];
+        } else {
+            g_printerr("invalid trigger: %s\n", *key);
+            g_strfreev(values);
+            continue;
+        }
+
+        set->triggers.push_back(t);
+        g_strfreev(values);
+    }
+    g_strfreev(keys);
+
+    if (set->triggers.empty())
+        return {};
+    for (trigger &t : set->triggers) {
+        for (size_t i = 1; i < t.literal.size(); i++) {
+            if (byte_frequency((unsigned char)t.literal[i]) <
+                byte_frequency((unsigned char)t.literal[t.rare]))
+                t.rare = i;
+        }
+    }
+    return set;
+}
+
+static const struct {
+    const char *name;
+    key_action action;
+} key_action_names[] = {
+    { "none",                key_action::none                },
+    { "fullscreen",          key_action::fullscreen          },
+    { "increase_font_scale", key_action::increase_font_scale },
+    { "decrease_font_scale", key_action::decrease_font_scale },
+    { "reset_font_scale",    key_action::reset_font_scale    },
+    { "next_font",           key_action::next_font           },
+    { "copy",                key_action::copy_clipboard      },
+    { "paste",               key_action::paste_clipboard     },
+    { "reload_config",       key_action::reload_config       },
+    { "new_tab",             key_action::new_tab             },
+    { "next_tab",            key_action::next_tab            },
+    { "previous_tab",        key_action::previous_tab        },
+    { "split_horizontal",    key_action::split_horizontal    },
+    { "split_vertical",      key_action::split_vertical      },
+    { "next_pane",           key_action::next_pane           },
+    { "previous_pane",       key_action::previous_pane       },
+    { "next_theme",          key_action::next_theme          },
+    { "export_scrollback",   key_action::export_scrollback   },
+    { "export_scrollback_ansi", key_action::export_scrollback_ansi },
+    { "previous_prompt",     key_action::previous_prompt     },
+    { "next_prompt",         key_action::next_prompt         },
+    { "copy_last_output",    key_action::copy_last_output    },
+};
+
+static void bind_key(key_table *table, unsigned modifiers, guint keyval, key_action action,
+                     const std::string &feed = {}) {
+    const size_t slot = key_slot(gdk_keyval_to_lower(keyval));
+    if (slot == key_slots)
+        return;
+
+    uint16_t index = 0;
+    if (action != key_action::none) {
+        table->entries.push_back({action, feed});
+        index = (uint16_t)(table->entries.size() - 1);
+    }
+    for (size_t m = 0; m < key_modifier_combinations; m++) {
+        if (modifiers & KEY_ANY || m == modifiers)
+            table->slots[m * key_slots + slot] = index;
+    }
+}
+
+static bool parse_key(const char *spec, unsigned *modifiers, guint *keyval) {
+    char **parts = g_strsplit(spec, "+", -1);
+    const guint n = g_strv_length(parts);
+    bool valid = n > 0;
+
+    *modifiers = 0;
+    for (guint i = 0; valid && i + 1 < n; i++) {
+        if (!g_ascii_strcasecmp(parts[i], "ctrl") || !g_ascii_strcasecmp(parts[i], "control")) {
+            *modifiers |= KEY_CONTROL;
+        } else if (!g_ascii_strcasecmp(parts[i], "shift")) {
+            *modifiers |= KEY_SHIFT;
+        } else if (!g_ascii_strcasecmp(parts[i], "alt")) {
+            *modifiers |= KEY_ALT;
+        } else if (!g_ascii_strcasecmp(parts[i], "super")) {
+            *modifiers |= KEY_SUPER;
+        } else {
+            valid = false;
+        }
+    }
+    if (valid) {
+        *keyval = gdk_keyval_from_name(parts[n - 1]);
+        valid = *keyval && *keyval != GDK_KEY_VoidSymbol && key_slot(*keyval) != key_slots;
+    }
+
+    g_strfreev(parts);
+    return valid;
+}
+
+static key_table compile_keys(GKeyFile *config, gboolean modify_other_keys) {
+    key_table table {std::vector<uint16_t>(key_modifier_combinations * key_slots),
+                     {{key_action::none, {}}}};
+
+    if (modify_other_keys) {
+        for (const modify_key &key : modify_keys) {
+            bind_key(&table, KEY_CONTROL, key.keyval, key_action::feed, key.control);
+            bind_key(&table, KEY_CONTROL|KEY_SHIFT, key.keyval, key_action::feed, key.control);
+            bind_key(&table, KEY_CONTROL|KEY_ALT, key.keyval, key_action::feed, key.meta);
+            bind_key(&table, KEY_CONTROL|KEY_ALT|KEY_SHIFT, key.keyval, key_action::feed, key.meta);
+        }
+    }
+
+    for (const key_binding &binding : default_bindings) {
+        bind_key(&table, binding.modifiers, binding.keyval, binding.action);
+    }
+
+    char **keys = config ? g_key_file_get_keys(config, "keybindings", nullptr, nullptr) : nullptr;
+    for (char **key = keys; key && *key; key++) {
+        unsigned modifiers;
+        guint keyval;
+        if (!parse_key(*key, &modifiers, &keyval)) {
+            g_printerr("invalid key: %s\n", *key);
+            continue;
+        }
+
+        char *value = g_key_file_get_value(config, "keybindings", *key, nullptr);
+        g_strstrip(value);
+        if (g_str_has_prefix(value, "send:")) {
+            char *feed = g_strcompress(value + strlen("send:"));
+            bind_key(&table, modifiers, keyval, key_action::feed, feed);
+            g_free(feed);
+        } else {
+            auto it = std::find_if(std::begin(key_action_names), std::end(key_action_names),
+                                   [value](decltype(key_action_names[0]) &entry) {
+                return !g_ascii_strcasecmp(entry.name, value);
+            });
+            if (it != std::end(key_action_names)) {
+                bind_key(&table, modifiers, keyval, it->action);
+            } else {
+                g_printerr("invalid key action: %s\n", value);
+            }
+        }
+        g_free(value);
+    }
+    g_strfreev(keys);
+
+    return table;
+}
+
+/* Same defaults as VTE: the 16 ANSI colors, a 6x6x6 color cube and a 24 step grayscale ramp */
+static GdkRGBA default_palette_color(unsigned index) {
+    GdkRGBA color {0, 0, 0, 1};
+    if (index < 16) {
+        const double base = index > 7 ? 0x3fff / 65535.0 : 0;
+        color.red = base + (index & 1 ? 0xc000 / 65535.0 : 0);
+        color.green = base + (index & 2 ? 0xc000 / 65535.0 : 0);
+        color.blue = base + (index & 4 ? 0xc000 / 65535.0 : 0);
+    } else if (index < 232) {
+        auto level = [](unsigned step) { return step ? (step * 40 + 55) / 255.0 : 0; };
+        const unsigned cube = index - 16;
+        color.red = level(cube / 36);
+        color.green = level(cube / 6 % 6);
+        color.blue = level(cube % 6);
+    } else {
+        color.red = color.green = color.blue = (8 + (index - 232) * 10) / 255.0;
+    }
+    return color;
+}
+
+static color_theme load_theme(GKeyFile *config, const char *group, const char *name) {
+    color_theme theme;
+    theme.name = name;
+    theme.foreground = get_config_color(config, group, "foreground");
+    theme.foreground_bold = get_config_color(config, group, "foreground_bold");
+    theme.background = get_config_color(config, group, "background");
+    theme.cursor = get_config_color(config, group, "cursor");
+    theme.cursor_foreground = get_config_color(config, group, "cursor_foreground");
+    theme.highlight = get_config_color(config, group, "highlight");
+    theme.provider = nullptr;
+
+    std::vector<maybe<GdkRGBA>> colors(256);
+    unsigned size = 0;
+    for (unsigned i = 0; i < colors.size(); i++) {
+        char key[16];
+        snprintf(key, sizeof key, "color%u", i);
+        colors[i] = get_config_color(config, group, key);
+        if (colors[i]) {
+            size = i < 16 ? std::max(size, 16u) : 256;
+        }
+    }
+    for (unsigned i = 0; i < size; i++) {
+        theme.palette.push_back(colors[i].get_value_or(default_palette_color(i)));
+    }
+
+    if (theme.background) {
+        theme.provider = gtk_css_provider_new();
+        load_background_color(theme.provider, &*theme.background);
+    }
+    return theme;
+}
+
+/*
+ * [colors] is the default theme, further themes are named [colors <name>] groups. The previous
+ * themes' providers stay alive while they are attached to the window.
+ */
+static void load_themes(config_info *info, GKeyFile *config, const std::string &current) {
+    for (const color_theme &theme : info->themes) {
+        if (theme.provider)
+            g_object_unref(theme.provider);
+    }
+    info->themes.clear();
+    info->current_theme = 0;
+
+    char **groups = g_key_file_get_groups(config, nullptr);
+    for (char **group = groups; *group; group++) {
+        if (!strcmp(*group, "colors")) {
+            info->themes.insert(info->themes.begin(), load_theme(config, *group, "default"));
+        } else if (g_str_has_prefix(*group, "colors ")) {
+            info->themes.push_back(load_theme(config, *group, *group + strlen("colors ")));
+        }
+    }
+    g_strfreev(groups);
+
+    for (size_t i = 0; i < info->themes.size(); i++) {
+        if (info->themes[i].name == current)
+            info->current_theme = i;
+    }
+}
+
+static void apply_theme(VteTerminal *vte, const color_theme &theme) {
+    vte_terminal_set_colors(vte, theme.foreground.get(), theme.background.get(),
+                            theme.palette.empty() ? nullptr : theme.palette.data(),
+                            theme.palette.size());
+
+    // vte_terminal_set_colors resets these, null restores the defaults
+    const GdkRGBA *bold = theme.foreground_bold ? theme.foreground_bold.get()
+                                                : theme.foreground.get();
+    vte_terminal_set_color_bold(vte, bold);
+    vte_terminal_set_color_cursor(vte, theme.cursor.get());
+    vte_terminal_set_color_cursor_foreground(vte, theme.cursor_foreground.get());
+    vte_terminal_set_color_highlight(vte, theme.highlight.get());
+}
+
+static void load_config(config_info *info, char **geometry, char **icon) {
+    phase_scope phase("load config");
+    const std::string default_path = "/termite/config";
+    GKeyFile *config = g_key_file_new();
+
+    gboolean loaded = FALSE;
+
+    if (info->config_file) {
+        loaded = g_key_file_load_from_file(config,
+                                           info->config_file,
+                                           G_KEY_FILE_NONE, nullptr);
+    }
+
+    if (!loaded) {
+        loaded = g_key_file_load_from_file(config,
+                                           (g_get_user_config_dir() + default_path).c_str(),
+                                           G_KEY_FILE_NONE, nullptr);
+    }
+
+    for (const char *const *dir = g_get_system_config_dirs();
+         !loaded && *dir; dir++) {
+        loaded = g_key_file_load_from_file(config, (*dir + default_path).c_str(),
+                                           G_KEY_FILE_NONE, nullptr);
+    }
+
+    if (loaded) {
+        set_config(info, geometry, icon, config);
+    }
+    g_key_file_free(config);
+}
+
+static void set_config(config_info *info, char **geometry, char **icon, GKeyFile *config) {
+    if (geometry) {
+        if (auto s = get_config_string(config, "options", "geometry")) {
+            *geometry = *s;
+        }
+    }
+
+    auto cfg_bool = [config](const char *key, gboolean value) {
+        return get_config<gboolean>(g_key_file_get_boolean,
+                                    config, "options", key).get_value_or(value);
+    };
+
+    info->options.emplace();
+    terminal_options &options = *info->options;
+    options.scroll_on_output = cfg_bool("scroll_on_output", FALSE);
+    options.scroll_on_keystroke = cfg_bool("scroll_on_keystroke", TRUE);
+    options.audible_bell = cfg_bool("audible_bell", FALSE);
+    options.mouse_autohide = cfg_bool("mouse_autohide", TRUE);
+    options.allow_bold = cfg_bool("allow_bold", TRUE);
+    options.search_wrap = cfg_bool("search_wrap", TRUE);
+    info->dynamic_title = cfg_bool("dynamic_title", TRUE);
+    info->urgent_on_bell = cfg_bool("urgent_on_bell", TRUE);
+    info->size_hints = cfg_bool("size_hints", FALSE);
+    info->modify_other_keys = cfg_bool("modify_other_keys", FALSE);
+    info->fullscreen = cfg_bool("fullscreen", TRUE);
+    info->keys = compile_keys(config, info->modify_other_keys);
+    info->font_scale = PANGO_SCALE_MEDIUM;
+    info->resize_interval = std::max(get_config_integer(config, "options", "resize_interval")
+                                     .get_value_or(default_resize_interval), 0);
+    info->stall_threshold = std::max(get_config_integer(config, "options", "stall_threshold")
+                                     .get_value_or(0), 0);
+    info->stall_backtrace = cfg_bool("stall_backtrace", FALSE);
+
+    if (auto s = get_config_string(config, "options", "font")) {
+        for (PangoFontDescription *font : info->fonts) {
+            pango_font_description_free(font);
+        }
+        info->fonts = split_fonts(*s);
+        info->current_font = 0;
+        g_free(*s);
+    }
+
+    if (auto i = get_config_integer(config, "options", "scrollback_lines")) {
+        options.scrollback_lines = *i;
+    }
+
+    if (auto s = get_config_string(config, "options", "cursor_blink")) {
+        if (!g_ascii_strcasecmp(*s, "system")) {
+            options.cursor_blink = VTE_CURSOR_BLINK_SYSTEM;
+        } else if (!g_ascii_strcasecmp(*s, "on")) {
+            options.cursor_blink = VTE_CURSOR_BLINK_ON;
+        } else if (!g_ascii_strcasecmp(*s, "off")) {
+            options.cursor_blink = VTE_CURSOR_BLINK_OFF;
+        }
+        g_free(*s);
+    }
+
+    if (auto s = get_config_string(config, "options", "cursor_shape")) {
+        if (!g_ascii_strcasecmp(*s, "block")) {
+            options.cursor_shape = VTE_CURSOR_SHAPE_BLOCK;
+        } else if (!g_ascii_strcasecmp(*s, "ibeam")) {
+            options.cursor_shape = VTE_CURSOR_SHAPE_IBEAM;
+        } else if (!g_ascii_strcasecmp(*s, "underline")) {
+            options.cursor_shape = VTE_CURSOR_SHAPE_UNDERLINE;
+        }
+        g_free(*s);
+    }
+
+    if (icon) {
+        if (auto s = get_config_string(config, "options", "icon_name")) {
+            *icon = *s;
+        }
+    }
+
+    info->export_directory.clear();
+    if (auto s = get_config_string(config, "options", "export_directory")) {
+        if (g_str_has_prefix(*s, "~/")) {
+            info->export_directory = std::string(g_get_home_dir()) + (*s + 1);
+        } else {
+            info->export_directory = *s;
+        }
+        g_free(*s);
+    }
+
+    std::string theme_name = info->themes.empty() ? "" : info->themes[info->current_theme].name;
+    if (auto s = get_config_string(config, "options", "theme")) {
+        theme_name = *s;
+        g_free(*s);
+    }
+    load_themes(info, config, theme_name);
+
+    info->triggers = load_triggers(config);
+}
+
+static void apply_terminal_config(VteTerminal *vte, const config_info &config) {
+    phase_scope phase("apply config");
+    if (!config.fonts.empty()) {
+        vte_terminal_set_font(vte, config.fonts[config.current_font]);
+    }
+
+    const terminal_options *options = config.options.get();
+    if (!options) {
+        return;
+    }
+
+    vte_terminal_set_scroll_on_output(vte, options->scroll_on_output);
+    vte_terminal_set_scroll_on_keystroke(vte, options->scroll_on_keystroke);
+    vte_terminal_set_audible_bell(vte, options->audible_bell);
+    vte_terminal_set_mouse_autohide(vte, options->mouse_autohide);
+    vte_terminal_set_allow_bold(vte, options->allow_bold);
+    vte_terminal_search_set_wrap_around(vte, options->search_wrap);
+
+    if (options->scrollback_lines) {
+        vte_terminal_set_scrollback_lines(vte, *options->scrollback_lines);
+    }
+    if (options->cursor_blink) {
+        vte_terminal_set_cursor_blink_mode(vte, *options->cursor_blink);
+    }
+    if (options->cursor_shape) {
+        vte_terminal_set_cursor_shape(vte, *options->cursor_shape);
+    }
+
+    if (!config.themes.empty()) {
+        apply_theme(vte, config.themes[config.current_theme]);
+    }
+}
+
+static void apply_window_theme(keybind_info *info) {
+    const config_info &config = info->config;
+    GtkCssProvider *provider = config.themes.empty() ? nullptr
+                                                     : config.themes[config.current_theme].provider;
+    if (provider == background_provider) {
+        return;
+    }
+
+    GtkStyleContext *context = gtk_widget_get_style_context(GTK_WIDGET(info->window));
+    if (background_provider) {
+        gtk_style_context_remove_provider(context, GTK_STYLE_PROVIDER(background_provider));
+    }
+    if (provider) {
+        add_css_provider(GTK_WIDGET(info->window), provider);
+    }
+    background_provider = provider;
+}
+
+// Returns FALSE with nothing to switch to, so the key reaches the child
+gboolean next_theme(keybind_info *info) {
+    config_info &config = info->config;
+    if (config.themes.size() < 2) {
+        return FALSE;
+    }
+
+    config.current_theme = (config.current_theme + 1) % config.themes.size();
+    for (VteTerminal *vte : get_terminals(GTK_WIDGET(info->notebook))) {
+        apply_theme(vte, config.themes[config.current_theme]);
+    }
+    apply_window_theme(info);
+    return TRUE;
+}
+
+static void apply_config(keybind_info *info) {
+    for (VteTerminal *vte : get_terminals(GTK_WIDGET(info->notebook))) {
+        apply_terminal_config(vte, info->config);
+    }
+    apply_window_theme(info);
+
+    update_size_hints(info);
+    watch_stalls(info->config);
+}/*}}}*/
+
+static void exit_with_status(VteTerminal *, int status) {
+    gtk_main_quit();
+    exit(WIFEXITED(status) ? WEXITSTATUS(status) : EXIT_FAILURE);
+}
+
+static void exit_with_success(VteTerminal *) {
+    gtk_main_quit();
+    exit(EXIT_SUCCESS);
+}
+
+static char *get_user_shell_with_fallback() {
+    if (const char *env = g_getenv("SHELL"))
+        return g_strdup(env);
+
+    if (char *command = vte_get_user_shell())
+        return command;
+
+    return g_strdup("/bin/sh");
+}
+
+/* {{{ SPAWN HELPER */
+/*
+ * Children are forked by a small helper process started at the top of main(), before GTK and
+ * VTE are initialized, so spawn latency doesn't grow with the size of termise itself. The helper
+ * opens the PTY, forks and execs the child, then passes the PTY master back over a socket and
+ * reports the exit status once the child has been reaped. Trigger commands are forked by it too,
+ * without a PTY.
+ */
+enum helper_reply_kind : int32_t {
+    HELPER_SPAWNED,
+    HELPER_EXITED
+};
+
+struct helper_reply {
+    int32_t kind;
+    int32_t pid;
+    int32_t value; // errno for HELPER_SPAWNED, wait status for HELPER_EXITED
+};
+
+static int helper_fd = -1;
+static guint helper_source;
+static int helper_sigchld_fd = -1;
+static std::map<GPid, VteTerminal *> helper_children;
+
+static bool read_all(int fd, void *buf, size_t len) {
+    char *p = static_cast<char *>(buf);
+    while (len) {
+        ssize_t n = read(fd, p, len);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        len -= (size_t)n;
+    }
+    return true;
+}
+
+// without SIGPIPE if the helper has gone away
+static bool send_all(int fd, const void *buf, size_t len) {
+    const char *p = static_cast<const char *>(buf);
+    while (len) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        len -= (size_t)n;
+    }
+    return true;
+}
+
+static bool send_reply(int fd, const helper_reply &reply, int pty_fd) {
+    iovec iov = {const_cast<helper_reply *>(&reply), sizeof reply};
+    char control[CMSG_SPACE(sizeof(int))] = {};
+    msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    if (pty_fd != -1) {
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof control;
+        cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &pty_fd, sizeof(int));
+    }
+
+    ssize_t n;
+    do {
+        n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+    } while (n == -1 && errno == EINTR);
+    return n == sizeof reply;
+}
+
+static bool recv_reply(int fd, helper_reply *reply, int *pty_fd) {
+    iovec iov = {reply, sizeof *reply};
+    char control[CMSG_SPACE(sizeof(int))] = {};
+    msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof control;
+
+    ssize_t n;
+    do {
+        n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+    } while (n == -1 && errno == EINTR);
+    if (n <= 0)
+        return false;
+    if ((size_t)n < sizeof *reply && !read_all(fd, (char *)reply + n, sizeof *reply - (size_t)n))
+        return false;
+
+    *pty_fd = -1;
+    for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+            memcpy(pty_fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+    return true;
+}
+
+static void helper_sigchld(int) {
+    const int saved_errno = errno;
+    const char c = 0;
+    ssize_t n = write(helper_sigchld_fd, &c, 1);
+    (void)n;
+    errno = saved_errno;
+}
+
+static bool helper_attach_pty(const char *pts) {
+    setsid();
+    int slave = open(pts, O_RDWR);
+    if (slave == -1 || ioctl(slave, TIOCSCTTY, 0) == -1)
+        return false;
+    dup2(slave, STDIN_FILENO);
+    dup2(slave, STDOUT_FILENO);
+    dup2(slave, STDERR_FILENO);
+    if (slave > STDERR_FILENO)
+        close(slave);
+    return true;
+}
+
+// Runs in the freshly forked child, never returns. Without a pts, the child keeps the helper's
+// stdio and session.
+[[noreturn]] static void helper_exec(const char *pts, const char *cwd, char **argv, char **env,
+                                     int error_fd) {
+    // like g_spawn in VTE, the child starts with default dispositions and nothing blocked
+    for (int sig = 1; sig < NSIG; sig++)
+        signal(sig, SIG_DFL);
+    sigset_t set;
+    sigemptyset(&set);
+    sigprocmask(SIG_SETMASK, &set, nullptr);
+
+    if (!pts || helper_attach_pty(pts)) {
+        if (chdir(cwd) == -1) {
+            // stay in the helper's directory, like a missing cwd in g_spawn
+        }
+        environ = env;
+        execvp(argv[0], argv);
+    }
+
+    const int err = errno;
+    ssize_t n = write(error_fd, &err, sizeof err);
+    (void)n;
+    _exit(127);
+}
+
+static helper_reply helper_spawn(std::vector<char> &request) {
+    helper_reply reply {HELPER_SPAWNED, -1, 0};
+    if (request.back() != '\0') {
+        reply.value = EINVAL;
+        return reply;
+    }
+
+    // argv and envp counts, then the rows and columns of the terminal, 0x0 for no terminal
+    uint32_t counts[4];
+    memcpy(counts, request.data(), sizeof counts);
+
+    // cwd, argv and envp are packed as consecutive NUL-terminated strings
+    std::vector<char *> strings;
+    for (size_t i = sizeof counts; i < request.size(); i += strlen(&request[i]) + 1)
+        strings.push_back(&request[i]);
+    if (strings.size() != 1 + counts[0] + counts[1] || !counts[0]) {
+        reply.value = EINVAL;
+        return reply;
+    }
+
+    std::vector<char *> argv(strings.begin() + 1, strings.begin() + 1 + counts[0]);
+    std::vector<char *> env(strings.begin() + 1 + counts[0], strings.end());
+    argv.push_back(nullptr);
+    env.push_back(nullptr);
+
+    const bool terminal = counts[2] && counts[3];
+    int master = -1;
+    int error_pipe[2];
+    if ((terminal && ((master = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC)) == -1 ||
+                      grantpt(master) == -1 || unlockpt(master) == -1)) ||
+        pipe2(error_pipe, O_CLOEXEC) == -1) {
+        reply.value = errno;
+        if (master != -1)
+            close(master);
+        return reply;
+    }
+    const std::string pts = terminal ? ptsname(master) : "";
+
+    // set before the child starts, so it doesn't see a 0x0 terminal
+    if (terminal) {
+        winsize size = {};
+        size.ws_row = (unsigned short)counts[2];
+        size.ws_col = (unsigned short)counts[3];
+        ioctl(master, TIOCSWINSZ, &size);
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(error_pipe[0]);
+        helper_exec(terminal ? pts.c_str() : nullptr, strings[0], argv.data(), env.data(),
+                    error_pipe[1]);
+    }
+    close(error_pipe[1]);
+
+    if (pid == -1) {
+        reply.value = errno;
+    } else if (!read_all(error_pipe[0], &reply.value, sizeof reply.value)) {
+        reply.pid = pid;
+        reply.value = 0;
+    } else {
+        waitpid(pid, nullptr, 0);
+    }
+    close(error_pipe[0]);
+
+    if (!reply.value && !send_reply(helper_fd, reply, master))
+        _exit(EXIT_FAILURE);
+    if (master != -1)
+        close(master);
+    return reply;
+}
+
+[[noreturn]] static void helper_main() {
+    int sigchld_pipe[2];
+    if (pipe2(sigchld_pipe, O_CLOEXEC | O_NONBLOCK) == -1)
+        _exit(EXIT_FAILURE);
+    helper_sigchld_fd = sigchld_pipe[1];
+
+    struct sigaction sa = {};
+    sa.sa_handler = helper_sigchld;
+    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGCHLD, &sa, nullptr);
+    signal(SIGINT, SIG_IGN);
+
+    for (;;) {
+        pollfd fds[2] = {{helper_fd, POLLIN, 0}, {sigchld_pipe[0], POLLIN, 0}};
+        if (poll(fds, 2, -1) == -1) {
+            if (errno == EINTR)
+                continue;
+            _exit(EXIT_FAILURE);
+        }
+
+        if (fds[1].revents & POLLIN) {
+            char buf[64];
+            while (read(sigchld_pipe[0], buf, sizeof buf) > 0) {}
+
+            int status;
+            pid_t pid;
+            while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+                if (!send_reply(helper_fd, {HELPER_EXITED, pid, status}, -1))
+                    _exit(EXIT_FAILURE);
+            }
+        }
+
+        if (fds[0].revents & (POLLIN | POLLHUP)) {
+            uint32_t size;
+            if (!read_all(helper_fd, &size, sizeof size))
+                _exit(EXIT_SUCCESS); // termise has gone away
+            std::vector<char> request(size);
+            if (size < 4 * sizeof(uint32_t) || !read_all(helper_fd, request.data(), size))
+                _exit(EXIT_FAILURE);
+
+            helper_reply reply = helper_spawn(request);
+            if (reply.value && !send_reply(helper_fd, reply, -1))
+                _exit(EXIT_FAILURE);
+        }
+    }
+}
+
+static void start_spawn_helper() {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) == -1) {
+        perror("socketpair");
+        return;
+    }
+
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        close(fds[0]);
+        close(fds[1]);
+    } else if (pid == 0) {
+        close(fds[0]);
+        helper_fd = fds[1];
+        helper_main();
+    } else {
+        close(fds[1]);
+        helper_fd = fds[0];
+    }
+}
+
+static void helper_child_exited(GPid pid, int status) {
+    auto it = helper_children.find(pid);
+    if (it != helper_children.end()) {
+        VteTerminal *vte = it->second;
+        helper_children.erase(it);
+        g_signal_emit_by_name(vte, "child-exited", status);
+    }
+}
+
+static void helper_orphan_eof_cb(VteTerminal *vte) {
+    g_signal_handlers_disconnect_by_func(vte, (gpointer)helper_orphan_eof_cb, nullptr);
+    g_signal_emit_by_name(vte, "child-exited", 0);
+}
+
+/*
+ * Later spawns go through VTE. Exits of the helper's children can't be reported anymore, so their
+ * terminals close once their pty reaches EOF instead.
+ */
+static void helper_lost() {
+    g_printerr("spawn helper exited\n");
+    if (helper_source) {
+        g_source_remove(helper_source);
+        helper_source = 0;
+    }
+    close(helper_fd);
+    helper_fd = -1;
+    for (const auto &child : helper_children)
+        g_signal_connect(child.second, "eof", G_CALLBACK(helper_orphan_eof_cb), nullptr);
+    helper_children.clear();
+}
+
+static gboolean helper_cb(int fd, GIOCondition, void *) {
+    phase_scope phase("spawn helper");
+    helper_reply reply;
+    int pty_fd;
+    if (!recv_reply(fd, &reply, &pty_fd)) {
+        helper_source = 0;
+        helper_lost();
+        return G_SOURCE_REMOVE;
+    }
+    if (pty_fd != -1)
+        close(pty_fd);
+    if (reply.kind == HELPER_EXITED)
+        helper_child_exited(reply.pid, reply.value);
+    return G_SOURCE_CONTINUE;
+}
+
+// Sends a spawn request and waits for its reply, a PTY master comes back when rows and cols are set
+static gboolean helper_request(const char *cwd, char **argv, char **env, uint32_t rows,
+                               uint32_t cols, GPid *pid, int *pty_fd, GError **error) {
+    std::string payload;
+    if (cwd) {
+        payload.assign(cwd, strlen(cwd) + 1);
+    } else {
+        char *current = g_get_current_dir();
+        payload.assign(current, strlen(current) + 1);
+        g_free(current);
+    }
+
+    uint32_t counts[4] = {g_strv_length(argv), g_strv_length(env), rows, cols};
+    for (char **s = argv; *s; s++)
+        payload.append(*s, strlen(*s) + 1);
+    for (char **s = env; *s; s++)
+        payload.append(*s, strlen(*s) + 1);
+
+    const uint32_t size = (uint32_t)(sizeof counts + payload.size());
+    if (!send_all(helper_fd, &size, sizeof size) ||
+        !send_all(helper_fd, counts, sizeof counts) ||
+        !send_all(helper_fd, payload.data(), payload.size())) {
+        g_set_error(error, G_SPAWN_ERROR, G_SPAWN_ERROR_FAILED, "spawn helper: %s",
+                    g_strerror(errno));
+        helper_lost();
+        return FALSE;
+    }
+
+    // exit notifications for other children may be queued ahead of our reply
+    for (;;) {
+        helper_reply reply;
+        if (!recv_reply(helper_fd, &reply, pty_fd)) {
+            g_set_error(error, G_SPAWN_ERROR, G_SPAWN_ERROR_FAILED, "spawn helper exited");
+            helper_lost();
+            return FALSE;
+        }
+        if (reply.kind == HELPER_EXITED) {
+            helper_child_exited(reply.pid, reply.value);
+            continue;
+        }
+        if (reply.value) {
+            g_set_error(error, G_SPAWN_ERROR, G_SPAWN_ERROR_FAILED, "%s: %s", argv[0],
+                        g_strerror(reply.value));
+            return FALSE;
+        }
+        *pid = reply.pid;
+        return TRUE;
+    }
+}
+
+static gboolean helper_spawn_sync(VteTerminal *vte, const char *cwd, char **argv, char **env,
+                                  GError **error) {
+    GPid pid;
+    int pty_fd;
+    if (!helper_request(cwd, argv, env, (uint32_t)vte_terminal_get_row_count(vte),
+                        (uint32_t)vte_terminal_get_column_count(vte), &pid, &pty_fd, error))
+        return FALSE;
+
+    VtePty *pty = vte_pty_new_foreign_sync(pty_fd, nullptr, error);
+    if (!pty) {
+        close(pty_fd);
+        return FALSE;
+    }
+    vte_terminal_set_pty(vte, pty);
+    g_object_unref(pty);
+    helper_children[pid] = vte;
+    return TRUE;
+}
+
+static void helper_forget(VteTerminal *vte) {
+    for (auto it = helper_children.begin(); it != helper_children.end();) {
+        if (it->second == vte)
+            it = helper_children.erase(it);
+        else
+            ++it;
+    }
+}
+
+static gboolean spawn_child(VteTerminal *vte, const char *cwd, char **argv, char **env,
+                            GError **error) {
+    phase_scope phase("spawn");
+    if (helper_fd != -1) {
+        if (helper_spawn_sync(vte, cwd, argv, env, error))
+            return TRUE;
+        if (helper_fd != -1)
+            return FALSE; // the command failed, not the helper
+        g_clear_error(error);
+    }
+
+    GPid child_pid;
+    if (!vte_terminal_spawn_sync(vte, VTE_PTY_DEFAULT, cwd, argv, env, G_SPAWN_SEARCH_PATH,
+                                 nullptr, nullptr, &child_pid, nullptr, error))
+        return FALSE;
+    vte_terminal_watch_child(vte, child_pid);
+    return TRUE;
+}
+
+static void command_exited(GPid pid, int, gpointer) {
+    g_spawn_close_pid(pid);
+}
+
+/*
+ * Runs a command without a terminal and without waiting for it. The helper reaps it, the exit
+ * report is ignored since no terminal owns the pid.
+ */
+static gboolean spawn_command(char **argv, char **env, GError **error) {
+    phase_scope phase("spawn");
+    if (helper_fd != -1) {
+        GPid pid;
+        int pty_fd;
+        if (helper_request(nullptr, argv, env, 0, 0, &pid, &pty_fd, error))
+            return TRUE;
+        if (helper_fd != -1)
+            return FALSE;
+        g_clear_error(error);
+    }
+
+    // posix_spawn doesn't copy the address space of the GTK process like fork would
+    pid_t pid;
+    const int err = posix_spawnp(&pid, argv[0], nullptr, nullptr, argv, env);
+    if (err) {
+        g_set_error(error, G_SPAWN_ERROR, G_SPAWN_ERROR_FAILED, "%s: %s", argv[0],
+                    g_strerror(err));
+        return FALSE;
+    }
+    g_child_watch_add(pid, command_exited, nullptr);
+    return TRUE;
+}
+/* }}} */
+
+/* {{{ PROMPT MARKS */
+/*
+ * Rows where prompts start, in ascending order. VTE doesn't report OSC 133 shell integration
+ * marks, so the OSC 7 working directory update shells send before every prompt (see vte.sh)
+ * serves as the mark. Rows that were trimmed from the scrollback are dropped from the front.
+ * Changing the column count rewraps the scrollback and renumbers its rows, so the index starts
+ * over then.
+ */
+struct prompt_marks {
+    std::deque<long> rows;
+    long columns;
+};
+
+static prompt_marks *get_prompt_marks(VteTerminal *vte) {
+    return static_cast<prompt_marks *>(g_object_get_data(G_OBJECT(vte), "termise-prompts"));
+}
+
+static void check_prompt_columns(VteTerminal *vte, prompt_marks *marks) {
+    const long columns = vte_terminal_get_column_count(vte);
+    if (columns != marks->columns) {
+        marks->rows.clear();
+        marks->columns = columns;
+    }
+}
+
+static prompt_marks *current_prompt_marks(VteTerminal *vte, GtkAdjustment *adjustment) {
+    prompt_marks *marks = get_prompt_marks(vte);
+    check_prompt_columns(vte, marks);
+    const long first = (long)gtk_adjustment_get_lower(adjustment);
+    while (!marks->rows.empty() && marks->rows.front() < first)
+        marks->rows.pop_front();
+    return marks;
+}
+
+static void prompt_mark_cb(VteTerminal *vte) {
+    long column, row;
+    vte_terminal_get_cursor_position(vte, &column, &row);
+    GtkAdjustment *adjustment = gtk_scrollable_get_vadjustment(GTK_SCROLLABLE(vte));
+    std::deque<long> &rows = current_prompt_marks(vte, adjustment)->rows;
+
+    // the screen was cleared or reset, marks below the cursor are gone
+    rows.erase(std::lower_bound(rows.begin(), rows.end(), row), rows.end());
+    rows.push_back(row);
+}
+
+/*
+ * Scroll the previous (-1) or next (1) prompt from the top of the view to the top. FALSE if there
+ * is no prompt that way, so the key keeps scrolling by a line as in VTE.
+ */
+gboolean jump_prompt(VteTerminal *vte, int direction) {
+    GtkAdjustment *adjustment = gtk_scrollable_get_vadjustment(GTK_SCROLLABLE(vte));
+    const std::deque<long> &rows = current_prompt_marks(vte, adjustment)->rows;
+    const long top = (long)gtk_adjustment_get_value(adjustment);
+
+    if (direction < 0) {
+        auto it = std::lower_bound(rows.begin(), rows.end(), top);
+        if (it == rows.begin())
+            return FALSE;
+        gtk_adjustment_set_value(adjustment, (double)*--it);
+    } else {
+        auto it = std::upper_bound(rows.begin(), rows.end(), top);
+        if (it == rows.end())
+            return FALSE;
+        gtk_adjustment_set_value(adjustment, (double)*it);
+    }
+    return TRUE;
+}
+
+// the output of the last command is everything between the last two prompt lines
+gboolean copy_last_output(VteTerminal *vte) {
+    phase_scope phase("copy last output");
+    GtkAdjustment *adjustment = gtk_scrollable_get_vadjustment(GTK_SCROLLABLE(vte));
+    const std::deque<long> &rows = current_prompt_marks(vte, adjustment)->rows;
+    if (rows.size() < 2)
+        return FALSE;
+
+    const long first = rows[rows.size() - 2] + 1, last = rows.back() - 1;
+    if (first > last)
+        return TRUE;
+    char *text = vte_terminal_get_text_range(vte, first, 0, last,
+                                             vte_terminal_get_column_count(vte) - 1,
+                                             nullptr, nullptr, nullptr);
+    if (text) {
+        gtk_clipboard_set_text(gtk_clipboard_get(GDK_SELECTION_CLIPBOARD), text, -1);
+        g_free(text);
+    }
+    return TRUE;
+}
+
+// a rewrap emits contents-changed, by the time of the next key press it may have been undone
+static void prompt_contents_changed_cb(VteTerminal *vte) {
+    check_prompt_columns(vte, get_prompt_marks(vte));
+}
+
+static void watch_prompts(VteTerminal *vte) {
+    g_object_set_data_full(G_OBJECT(vte), "termise-prompts",
+                           new prompt_marks{{}, vte_terminal_get_column_count(vte)},
+                           [](gpointer data) {
+        delete static_cast<prompt_marks *>(data);
+    });
+    g_signal_connect(vte, "current-directory-uri-changed", G_CALLBACK(prompt_mark_cb), nullptr);
+    g_signal_connect(vte, "contents-changed", G_CALLBACK(prompt_contents_changed_cb), nullptr);
+}
+/* }}} */
+
+/* {{{ DEFERRED RESIZE */
+/*
+ * A grid change rewraps the whole scrollback and sends SIGWINCH to the child. While a window
+ * edge is dragged, terminals keep their old grid and the newest allocation is applied at most
+ * once per resize_interval, plus once after the last change. The window manager shows the new
+ * geometry right away from the size hints.
+ */
+struct resize_state {
+    keybind_info *info;
+    GtkAllocation applied;
+    bool has_applied;
+    bool apply; // let the next allocation through
+    gint64 last_apply;
+    guint timeout;
+};
+
+// cost of grid changes by scrollback size in rows
+static const long resize_buckets[] = {1000, 10000, 100000, G_MAXLONG};
+static struct {
+    uint64_t requested, deferred;
+    uint64_t applied[4], total_us[4], max_us[4];
+} resize_stats;
 
-    for (auto it = zoom_factors.begin(); it != zoom_factors.end(); ++it) {
-        if ((*it - scale) > 1e-6) {
-            vte_terminal_set_font_scale(vte, *it);
-            return;
-        }
-    }
+static resize_state *get_resize_state(VteTerminal *vte) {
+    return static_cast<resize_state *>(g_object_get_data(G_OBJECT(vte), "termise-resize"));
 }
 
-static void decrease_font_scale(VteTerminal *vte) {
-    gdouble scale = vte_terminal_get_font_scale(vte);
+static void grid_size(VteTerminal *vte, const GtkAllocation *allocation,
+                      long *columns, long *rows) {
+    int padding_left, padding_top, padding_right, padding_bottom;
+    get_vte_padding(vte, &padding_left, &padding_top, &padding_right, &padding_bottom);
+    *columns = (allocation->width - padding_left - padding_right) /
+               std::max(vte_terminal_get_char_width(vte), 1L);
+    *rows = (allocation->height - padding_top - padding_bottom) /
+            std::max(vte_terminal_get_char_height(vte), 1L);
+}
 
-    for (auto it = zoom_factors.rbegin(); it != zoom_factors.rend(); ++it) {
-        if ((scale - *it) > 1e-6) {
-            vte_terminal_set_font_scale(vte, *it);
-            return;
-        }
+static void apply_allocation(VteTerminal *vte, resize_state *state, GtkAllocation *allocation) {
+    long columns = 0, rows = 0, old_columns = 0, old_rows = 0;
+    if (state->has_applied) {
+        grid_size(vte, allocation, &columns, &rows);
+        grid_size(vte, &state->applied, &old_columns, &old_rows);
+    }
+    GtkAdjustment *adjustment = gtk_scrollable_get_vadjustment(GTK_SCROLLABLE(vte));
+    const long scrollback = (long)(gtk_adjustment_get_upper(adjustment) -
+                                   gtk_adjustment_get_lower(adjustment));
+
+    const gint64 start = g_get_monotonic_time();
+    g_signal_chain_from_overridden_handler(vte, allocation);
+    const gint64 end = g_get_monotonic_time();
+
+    if (columns != old_columns || rows != old_rows) {
+        size_t bucket = 0;
+        while (scrollback >= resize_buckets[bucket])
+            bucket++;
+        const uint64_t elapsed = (uint64_t)(end - start);
+        resize_stats.applied[bucket]++;
+        resize_stats.total_us[bucket] += elapsed;
+        resize_stats.max_us[bucket] = std::max(resize_stats.max_us[bucket], elapsed);
     }
+    state->applied = *allocation;
+    state->has_applied = true;
+    state->apply = false;
+    state->last_apply = end;
 }
 
-gboolean window_state_cb(GtkWindow *, GdkEventWindowState *event, keybind_info *info) {
-    if (event->new_window_state & GDK_WINDOW_STATE_FULLSCREEN)
-        info->fullscreen_toggle = gtk_window_unfullscreen;
-    else
-        info->fullscreen_toggle = gtk_window_fullscreen;
-    return FALSE;
+static gboolean resize_timeout_cb(gpointer data) {
+    VteTerminal *vte = VTE_TERMINAL(data);
+    resize_state *state = get_resize_state(vte);
+    state->timeout = 0;
+    state->apply = true;
+    gtk_widget_queue_allocate(GTK_WIDGET(vte));
+    return G_SOURCE_REMOVE;
 }
 
-gboolean key_press_cb(VteTerminal *vte, GdkEventKey *event, keybind_info *info) {
-    const guint modifiers = event->state & gtk_accelerator_get_default_mod_mask();
+// overrides the VteTerminal size-allocate class handler
+static void terminal_size_allocate(GtkWidget *widget, GtkAllocation *allocation) {
+    phase_scope phase("resize");
+    VteTerminal *vte = VTE_TERMINAL(widget);
+    resize_state *state = get_resize_state(vte);
+    if (!state) {
+        g_signal_chain_from_overridden_handler(widget, allocation);
+        return;
+    }
 
-    if (info->config.fullscreen && event->keyval == GDK_KEY_F11) {
-        info->fullscreen_toggle(info->window);
-        return TRUE;
+    // every grid change counts, whether or not deferral is enabled
+    long columns = 0, rows = 0, old_columns = 0, old_rows = 0;
+    if (state->has_applied) {
+        grid_size(vte, allocation, &columns, &rows);
+        grid_size(vte, &state->applied, &old_columns, &old_rows);
+    }
+    const bool grid_changed = columns != old_columns || rows != old_rows;
+    resize_stats.requested += grid_changed;
+    if (!grid_changed || state->apply || !state->info->config.resize_interval) {
+        apply_allocation(vte, state, allocation);
+        return;
     }
 
-    if (modifiers == (GDK_CONTROL_MASK|GDK_SHIFT_MASK)) {
-        switch (gdk_keyval_to_lower(event->keyval)) {
-            case GDK_KEY_plus:
-                increase_font_scale(vte);
-                return TRUE;
-            case GDK_KEY_underscore:
-                info->config.current_font++;
-                info->config.current_font %= info->config.fonts.size();
-                vte_terminal_set_font(vte, info->config.fonts[info->config.current_font]);
-                return TRUE;
-            case GDK_KEY_c:
-                vte_terminal_copy_clipboard(vte);
-                return TRUE;
-            case GDK_KEY_v:
-                vte_terminal_paste_clipboard(vte);
-                return TRUE;
-            case GDK_KEY_r:
-                reload_config();
-                return TRUE;
-            default:
-                if (modify_key_feed(event, info, modify_table))
-                    return TRUE;
-        }
-    } else if ((modifiers == (GDK_CONTROL_MASK|GDK_MOD1_MASK)) ||
-               (modifiers == (GDK_CONTROL_MASK|GDK_MOD1_MASK|GDK_SHIFT_MASK))) {
-        if (modify_key_feed(event, info, modify_meta_table))
-            return TRUE;
-    } else if (modifiers == GDK_CONTROL_MASK) {
-        switch (gdk_keyval_to_lower(event->keyval)) {
-            case GDK_KEY_minus:
-                decrease_font_scale(vte);
-                return TRUE;
-            case GDK_KEY_equal:
-                reset_font_scale(vte, info->config.font_scale);
-                return TRUE;
-            default:
-                if (modify_key_feed(event, info, modify_table))
-                    return TRUE;
-        }
+    const gint64 interval = state->info->config.resize_interval * G_TIME_SPAN_MILLISECOND;
+    const gint64 elapsed = g_get_monotonic_time() - state->last_apply;
+    if (elapsed >= interval && !state->timeout) {
+        apply_allocation(vte, state, allocation);
+        return;
     }
-    return FALSE;
-}
 
-static void bell_cb(GtkWidget *vte, gboolean *urgent_on_bell) {
-    if (*urgent_on_bell) {
-        gtk_window_set_urgency_hint(GTK_WINDOW(gtk_widget_get_toplevel(vte)), TRUE);
+    // keep the old grid at the new position until the timeout applies the latest allocation
+    resize_stats.deferred++;
+    GtkAllocation held = *allocation;
+    held.width = state->applied.width;
+    held.height = state->applied.height;
+    g_signal_chain_from_overridden_handler(widget, &held);
+    if (!state->timeout) {
+        const guint remaining = (guint)std::max<gint64>(
+            (interval - elapsed) / G_TIME_SPAN_MILLISECOND, 1);
+        state->timeout = g_timeout_add_full(G_PRIORITY_DEFAULT, remaining, resize_timeout_cb,
+                                            g_object_ref(vte), g_object_unref);
     }
 }
 
-gboolean focus_cb(GtkWindow *window) {
-    gtk_window_set_urgency_hint(window, FALSE);
-    return FALSE;
+static void watch_resize(VteTerminal *vte, keybind_info *info) {
+    g_object_set_data_full(G_OBJECT(vte), "termise-resize",
+                           new resize_state{info, {}, false, false, 0, 0}, [](gpointer data) {
+        delete static_cast<resize_state *>(data);
+    });
 }
 /* }}} */
 
-void get_vte_padding(VteTerminal *vte, int *left, int *top, int *right, int *bottom) {
-    GtkBorder border;
-    gtk_style_context_get_padding(gtk_widget_get_style_context(GTK_WIDGET(vte)),
-                                  gtk_widget_get_state_flags(GTK_WIDGET(vte)),
-                                  &border);
-    *left = border.left;
-    *right = border.right;
-    *top = border.top;
-    *bottom = border.bottom;
+/* {{{ TABS AND SPLITS */
+/*
+ * Every tab is a notebook page holding either a terminal or a tree of GtkPaned splits. All
+ * terminals share the window's config_info, fonts and CSS providers.
+ */
+static void collect_terminals(GtkWidget *widget, gpointer data) {
+    auto terminals = static_cast<std::vector<VteTerminal *> *>(data);
+    if (VTE_IS_TERMINAL(widget)) {
+        terminals->push_back(VTE_TERMINAL(widget));
+    } else if (GTK_IS_CONTAINER(widget)) {
+        gtk_container_foreach(GTK_CONTAINER(widget), collect_terminals, terminals);
+    }
 }
 
-/* {{{ CONFIG LOADING */
-template<typename T>
-maybe<T> get_config(T (*get)(GKeyFile *, const char *, const char *, GError **),
-                    GKeyFile *config, const char *group, const char *key) {
-    GError *error = nullptr;
-    maybe<T> value = get(config, group, key, &error);
-    if (error) {
-        g_error_free(error);
-        return {};
-    }
-    return value;
+static std::vector<VteTerminal *> get_terminals(GtkWidget *widget) {
+    std::vector<VteTerminal *> terminals;
+    collect_terminals(widget, &terminals);
+    return terminals;
 }
 
-auto get_config_integer(std::bind(get_config<int>, g_key_file_get_integer,
-                                  _1, _2, _3));
-auto get_config_string(std::bind(get_config<char *>, g_key_file_get_string,
-                                 _1, _2, _3));
-auto get_config_double(std::bind(get_config<double>, g_key_file_get_double,
-                                 _1, _2, _3));
+// Cell increments only line up while a single terminal fills the window
+void update_size_hints(keybind_info *info) {
+    if (!info->config.size_hints || !info->vte)
+        return;
+    set_size_hints(info->window, info->vte,
+                   get_terminals(GTK_WIDGET(info->notebook)).size() == 1);
+}
 
-static maybe<GdkRGBA> get_config_color(GKeyFile *config, const char *section, const char *key) {
-    if (auto s = get_config_string(config, section, key)) {
-        GdkRGBA color;
-        if (gdk_rgba_parse(&color, *s)) {
-            g_free(*s);
-            return color;
-        }
-        g_printerr("invalid color string: %s\n", *s);
-        g_free(*s);
+// The widget a terminal occupies in its split or notebook page
+static GtkWidget *pane_widget(keybind_info *info, GtkWidget *widget) {
+    for (GtkWidget *parent = gtk_widget_get_parent(widget); parent;
+         parent = gtk_widget_get_parent(widget)) {
+        if (GTK_IS_PANED(parent) || parent == GTK_WIDGET(info->notebook))
+            return widget;
+        widget = parent;
     }
-    return {};
+    return nullptr;
 }
 
-static std::vector<PangoFontDescription *> split_fonts (char *str) {
-    std::vector<PangoFontDescription *> ret;
-    std::string s(str);
-    std::string buf = "";
-    for (unsigned int i = 0; i<s.size(); i++) {
-        if (s[i] == ',') {
-            ret.push_back(pango_font_description_from_string(buf.data()));
-            buf = "";
-        } else buf += s[i];
+GtkWidget *page_widget(keybind_info *info, GtkWidget *widget) {
+    for (GtkWidget *parent = gtk_widget_get_parent(widget); parent;
+         parent = gtk_widget_get_parent(widget)) {
+        if (parent == GTK_WIDGET(info->notebook))
+            return widget;
+        widget = parent;
     }
-    ret.push_back(pango_font_description_from_string(buf.data()));
-    return ret;
+    return nullptr;
 }
 
-static void load_config(GtkWindow *window, VteTerminal *vte, config_info *info,
-                        char **geometry, char **icon) {
-    const std::string default_path = "/termite/config";
-    GKeyFile *config = g_key_file_new();
-
-    gboolean loaded = FALSE;
+static void focus_terminal(keybind_info *info, VteTerminal *vte) {
+    info->vte = vte;
+    gtk_widget_grab_focus(GTK_WIDGET(vte));
+    if (!info->fixed_title)
+        window_title_cb(vte, info);
+}
 
-    if (info->config_file) {
-        loaded = g_key_file_load_from_file(config,
-                                           info->config_file,
-                                           G_KEY_FILE_NONE, nullptr);
-    }
+static void focus_current_page(keybind_info *info) {
+    const gint page = gtk_notebook_get_current_page(info->notebook);
+    if (page == -1)
+        return;
+    std::vector<VteTerminal *> terminals = get_terminals(gtk_notebook_get_nth_page(info->notebook, page));
+    if (!terminals.empty())
+        focus_terminal(info, terminals.front());
+}
 
-    if (!loaded) {
-        loaded = g_key_file_load_from_file(config,
-                                           (g_get_user_config_dir() + default_path).c_str(),
-                                           G_KEY_FILE_NONE, nullptr);
+// Put replacement where old is, the caller must hold a reference to old to keep it alive
+static void replace_pane(keybind_info *info, GtkWidget *old, GtkWidget *replacement) {
+    GtkWidget *parent = gtk_widget_get_parent(old);
+    if (GTK_IS_PANED(parent)) {
+        GtkPaned *paned = GTK_PANED(parent);
+        const bool first = gtk_paned_get_child1(paned) == old;
+        gtk_container_remove(GTK_CONTAINER(paned), old);
+        if (first)
+            gtk_paned_pack1(paned, replacement, TRUE, FALSE);
+        else
+            gtk_paned_pack2(paned, replacement, TRUE, FALSE);
+    } else {
+        const gint page = gtk_notebook_page_num(info->notebook, old);
+        gtk_notebook_remove_page(info->notebook, page);
+        gtk_notebook_insert_page(info->notebook, replacement, nullptr, page);
+        gtk_notebook_set_current_page(info->notebook, page);
     }
+}
 
-    for (const char *const *dir = g_get_system_config_dirs();
-         !loaded && *dir; dir++) {
-        loaded = g_key_file_load_from_file(config, (*dir + default_path).c_str(),
-                                           G_KEY_FILE_NONE, nullptr);
+static void remove_terminal(keybind_info *info, VteTerminal *vte, int status) {
+    GtkWidget *pane = pane_widget(info, GTK_WIDGET(vte));
+    if (!pane)
+        return;
+
+    // the terminal is still referenced, destroy hasn't cleared info->vte yet
+    const bool focused = !info->vte || info->vte == vte;
+    GtkWidget *parent = gtk_widget_get_parent(pane);
+    if (GTK_IS_PANED(parent)) {
+        GtkPaned *paned = GTK_PANED(parent);
+        GtkWidget *sibling = gtk_paned_get_child1(paned) == pane ? gtk_paned_get_child2(paned)
+                                                                 : gtk_paned_get_child1(paned);
+        g_object_ref(sibling);
+        gtk_container_remove(GTK_CONTAINER(paned), sibling);
+        replace_pane(info, GTK_WIDGET(paned), sibling);
+        g_object_unref(sibling);
+    } else {
+        gtk_notebook_remove_page(info->notebook, gtk_notebook_page_num(info->notebook, pane));
     }
 
-    if (loaded) {
-        set_config(window, vte, info, geometry, icon, config);
+    if (!gtk_notebook_get_n_pages(info->notebook)) {
+        exit_with_status(vte, status);
     }
-    g_key_file_free(config);
+    if (focused)
+        focus_current_page(info);
+    else if (!gtk_widget_has_focus(GTK_WIDGET(info->vte)))
+        gtk_widget_grab_focus(GTK_WIDGET(info->vte)); // moving the sibling pane drops its focus
+    update_size_hints(info);
 }
 
-static void set_config(GtkWindow *window, VteTerminal *vte, config_info *info,
-                        char **geometry, char **icon, GKeyFile *config) {
-    if (geometry) {
-        if (auto s = get_config_string(config, "options", "geometry")) {
-            *geometry = *s;
-        }
-    }
+struct exited_terminal {
+    keybind_info *info;
+    VteTerminal *vte;
+    int status;
+};
 
-    auto cfg_bool = [config](const char *key, gboolean value) {
-        return get_config<gboolean>(g_key_file_get_boolean,
-                                    config, "options", key).get_value_or(value);
-    };
+static gboolean remove_terminal_idle(gpointer data) {
+    std::unique_ptr<exited_terminal> exited(static_cast<exited_terminal *>(data));
+    remove_terminal(exited->info, exited->vte, exited->status);
+    g_object_unref(exited->vte);
+    return G_SOURCE_REMOVE;
+}
 
-    vte_terminal_set_scroll_on_output(vte, cfg_bool("scroll_on_output", FALSE));
-    vte_terminal_set_scroll_on_keystroke(vte, cfg_bool("scroll_on_keystroke", TRUE));
-    vte_terminal_set_audible_bell(vte, cfg_bool("audible_bell", FALSE));
-    vte_terminal_set_mouse_autohide(vte, cfg_bool("mouse_autohide", TRUE));
-    vte_terminal_set_allow_bold(vte, cfg_bool("allow_bold", TRUE));
-    vte_terminal_search_set_wrap_around(vte, cfg_bool("search_wrap", TRUE));
-    info->dynamic_title = cfg_bool("dynamic_title", TRUE);
-    info->urgent_on_bell = cfg_bool("urgent_on_bell", TRUE);
-    info->size_hints = cfg_bool("size_hints", FALSE);
-    info->modify_other_keys = cfg_bool("modify_other_keys", FALSE);
-    info->fullscreen = cfg_bool("fullscreen", TRUE);
-    info->font_scale = vte_terminal_get_font_scale(vte);
+static void child_exited_cb(VteTerminal *vte, int status, keybind_info *info) {
+    if (info->hold)
+        return;
+    // don't tear down the widget while it is still emitting
+    g_idle_add(remove_terminal_idle, new exited_terminal{info, VTE_TERMINAL(g_object_ref(vte)), status});
+}
 
-    if (auto s = get_config_string(config, "options", "font")) {
-        info->fonts = split_fonts(*s);
-        info->current_font = 0;
-        vte_terminal_set_font(vte, info->fonts[info->current_font]);
-        g_free(*s);
-    }
+static gboolean terminal_focus_cb(GtkWidget *widget, GdkEvent *, keybind_info *info) {
+    info->vte = VTE_TERMINAL(widget);
+    if (!info->fixed_title)
+        window_title_cb(info->vte, info);
+    return FALSE;
+}
 
-    if (auto i = get_config_integer(config, "options", "scrollback_lines")) {
-        vte_terminal_set_scrollback_lines(vte, *i);
-    }
+static void terminal_destroy_cb(GtkWidget *widget, keybind_info *info) {
+    helper_forget(VTE_TERMINAL(widget));
+    if (info->vte == VTE_TERMINAL(widget))
+        info->vte = nullptr;
+}
 
-    if (auto s = get_config_string(config, "options", "cursor_blink")) {
-        if (!g_ascii_strcasecmp(*s, "system")) {
-            vte_terminal_set_cursor_blink_mode(vte, VTE_CURSOR_BLINK_SYSTEM);
-        } else if (!g_ascii_strcasecmp(*s, "on")) {
-            vte_terminal_set_cursor_blink_mode(vte, VTE_CURSOR_BLINK_ON);
-        } else if (!g_ascii_strcasecmp(*s, "off")) {
-            vte_terminal_set_cursor_blink_mode(vte, VTE_CURSOR_BLINK_OFF);
-        }
-        g_free(*s);
-    }
+static VteTerminal *new_terminal(keybind_info *info) {
+    phase_scope phase("new terminal");
+    GtkWidget *vte_widget = vte_terminal_new();
+    VteTerminal *vte = VTE_TERMINAL(vte_widget);
 
-    if (auto s = get_config_string(config, "options", "cursor_shape")) {
-        if (!g_ascii_strcasecmp(*s, "block")) {
-            vte_terminal_set_cursor_shape(vte, VTE_CURSOR_SHAPE_BLOCK);
-        } else if (!g_ascii_strcasecmp(*s, "ibeam")) {
-            vte_terminal_set_cursor_shape(vte, VTE_CURSOR_SHAPE_IBEAM);
-        } else if (!g_ascii_strcasecmp(*s, "underline")) {
-            vte_terminal_set_cursor_shape(vte, VTE_CURSOR_SHAPE_UNDERLINE);
-        }
-        g_free(*s);
-    }
+    add_css_provider(vte_widget, transparent_provider);
+    apply_terminal_config(vte, info->config);
 
-    if (icon) {
-        if (auto s = get_config_string(config, "options", "icon_name")) {
-            *icon = *s;
-        }
+    g_signal_connect(vte, "child-exited", G_CALLBACK(child_exited_cb), info);
+    g_signal_connect(vte, "key-press-event", G_CALLBACK(key_press_cb), info);
+    g_signal_connect(vte, "bell", G_CALLBACK(bell_cb), &info->config.urgent_on_bell);
+    g_signal_connect(vte, "focus-in-event", G_CALLBACK(terminal_focus_cb), info);
+    g_signal_connect(vte, "destroy", G_CALLBACK(terminal_destroy_cb), info);
+    if (!info->fixed_title) {
+        g_signal_connect(vte, "window-title-changed", G_CALLBACK(window_title_cb), info);
     }
+    watch_triggers(vte, info);
+    watch_resize(vte, info);
+    watch_prompts(vte);
 
-    if (info->size_hints) {
-        set_size_hints(GTK_WINDOW(window), vte);
-    }
+    gtk_widget_show(vte_widget);
+    return vte;
+}
 
-    if (auto color = get_config_color(config, "colors", "foreground")) {
-        vte_terminal_set_color_foreground(vte, &*color);
-        vte_terminal_set_color_bold(vte, &*color);
-    }
-    if (auto color = get_config_color(config, "colors", "foreground_bold")) {
-        vte_terminal_set_color_bold(vte, &*color);
-    }
-    if (auto color = get_config_color(config, "colors", "background")) {
-        vte_terminal_set_color_background(vte, &*color);
-        override_background_color(GTK_WIDGET(window), &*color);
-    }
-    if (auto color = get_config_color(config, "colors", "cursor")) {
-        vte_terminal_set_color_cursor(vte, &*color);
-    }
-    if (auto color = get_config_color(config, "colors", "cursor_foreground")) {
-        vte_terminal_set_color_cursor_foreground(vte, &*color);
-    }
-    if (auto color = get_config_color(config, "colors", "highlight")) {
-        vte_terminal_set_color_highlight(vte, &*color);
+static void spawn_shell(keybind_info *info, VteTerminal *vte, const char *cwd) {
+    GError *error = nullptr;
+    char *argv[2] = {info->shell, nullptr};
+    if (!spawn_child(vte, cwd, argv, info->env, &error)) {
+        g_printerr("the command failed to run: %s\n", error->message);
+        g_error_free(error);
+        remove_terminal(info, vte, EXIT_FAILURE << 8);
     }
+}
 
-}/*}}}*/
+// Directory of the focused terminal, as reported by the shell through OSC 7
+static char *current_directory(keybind_info *info) {
+    const char *uri = info->vte ? vte_terminal_get_current_directory_uri(info->vte) : nullptr;
+    return uri ? g_filename_from_uri(uri, nullptr, nullptr) : nullptr;
+}
 
-static void exit_with_status(VteTerminal *, int status) {
-    gtk_main_quit();
-    exit(WIFEXITED(status) ? WEXITSTATUS(status) : EXIT_FAILURE);
+void new_tab(keybind_info *info) {
+    char *cwd = current_directory(info);
+    VteTerminal *vte = new_terminal(info);
+    const gint page = gtk_notebook_append_page(info->notebook, GTK_WIDGET(vte), nullptr);
+    gtk_notebook_set_current_page(info->notebook, page);
+    focus_terminal(info, vte);
+    spawn_shell(info, vte, cwd);
+    g_free(cwd);
 }
 
-static void exit_with_success(VteTerminal *) {
-    gtk_main_quit();
-    exit(EXIT_SUCCESS);
+void split_terminal(keybind_info *info, GtkOrientation orientation) {
+    if (!info->vte)
+        return;
+
+    GtkWidget *pane = pane_widget(info, GTK_WIDGET(info->vte));
+    GtkAllocation allocation;
+    gtk_widget_get_allocation(pane, &allocation);
+
+    char *cwd = current_directory(info);
+    VteTerminal *vte = new_terminal(info);
+    GtkWidget *paned = gtk_paned_new(orientation);
+    add_css_provider(paned, transparent_provider);
+
+    g_object_ref(pane);
+    replace_pane(info, pane, paned);
+    gtk_paned_pack1(GTK_PANED(paned), pane, TRUE, FALSE);
+    g_object_unref(pane);
+    gtk_paned_pack2(GTK_PANED(paned), GTK_WIDGET(vte), TRUE, FALSE);
+    gtk_paned_set_position(GTK_PANED(paned), (orientation == GTK_ORIENTATION_HORIZONTAL
+                                              ? allocation.width : allocation.height) / 2);
+    gtk_widget_show(paned);
+
+    focus_terminal(info, vte);
+    update_size_hints(info);
+    spawn_shell(info, vte, cwd);
+    g_free(cwd);
 }
 
-static char *get_user_shell_with_fallback() {
-    if (const char *env = g_getenv("SHELL"))
-        return g_strdup(env);
+// FALSE if there is no other pane to switch to
+gboolean switch_pane(keybind_info *info, int offset) {
+    if (!info->vte)
+        return FALSE;
 
-    if (char *command = vte_get_user_shell())
-        return command;
+    std::vector<VteTerminal *> terminals = get_terminals(page_widget(info, GTK_WIDGET(info->vte)));
+    auto it = std::find(terminals.begin(), terminals.end(), info->vte);
+    if (it == terminals.end() || terminals.size() < 2)
+        return FALSE;
 
-    return g_strdup("/bin/sh");
+    const long n = (long)terminals.size();
+    const long index = ((it - terminals.begin() + offset) % n + n) % n;
+    focus_terminal(info, terminals[(size_t)index]);
+    return TRUE;
+}
+
+static void update_tabs_cb(GtkNotebook *notebook, GtkWidget *, guint, keybind_info *info) {
+    gtk_notebook_set_show_tabs(notebook, gtk_notebook_get_n_pages(notebook) > 1);
+    update_size_hints(info);
 }
 
+static void switch_page_cb(GtkNotebook *, GtkWidget *page, guint, keybind_info *info) {
+    std::vector<VteTerminal *> terminals = get_terminals(page);
+    if (!terminals.empty())
+        focus_terminal(info, terminals.front());
+}
+/* }}} */
+
 static void on_alpha_screen_changed(GtkWindow *window, GdkScreen *, void *) {
     GdkScreen *screen = gtk_widget_get_screen(GTK_WIDGET(window));
     GdkVisual *visual = gdk_screen_get_rgba_visual(screen);
@@ -512,7 +2731,266 @@ static void on_alpha_screen_changed(GtkWindow *window, GdkScreen *, void *) {
     gtk_widget_set_visual(GTK_WIDGET(window), visual);
 }
 
+/* {{{ STALL WATCHDOG */
+/*
+ * A high priority timeout keeps a heartbeat and a watchdog thread checks that it keeps moving.
+ * When it stops for longer than stall_threshold, the phase the main loop was tagged with, and
+ * optionally a backtrace of the main thread, are recorded. Once the main loop is back, the stall
+ * goes into a ring buffer and a histogram of durations for the SIGUSR2 stats dump.
+ */
+static const size_t stall_log_size = 64;
+static const int stall_max_frames = 32;
+static const gint64 stall_buckets_ms[] = {100, 250, 500, 1000, 2500, G_MAXINT64};
+
+struct stall_record {
+    gint64 time; // wall clock time the stall was noticed
+    gint64 duration_us;
+    const char *phase;
+    std::string backtrace;
+};
+
+static struct {
+    std::atomic<gint64> beat, threshold_us;
+    std::atomic<bool> backtrace;
+    guint heartbeat;
+    GThread *thread;
+    pthread_t main_thread;
+    bool handler_installed;
+    GMutex lock; // guards the log and histogram
+    stall_record log[stall_log_size];
+    uint64_t recorded;
+    uint64_t histogram[G_N_ELEMENTS(stall_buckets_ms)];
+} watchdog;
+
+/*
+ * Backtrace requests are numbered. The handler only writes the frames after claiming the current
+ * request, and the watchdog claims a request itself when it gives up waiting, so a late signal
+ * can't write the frames while they are read.
+ */
+static void *stall_frames[stall_max_frames];
+static int stall_frame_count;
+static std::atomic<unsigned> stall_requested, stall_claimed, stall_answered;
+
+static gint64 heartbeat_interval(gint64 threshold) {
+    return std::max<gint64>(threshold / 4, 5 * G_TIME_SPAN_MILLISECOND);
+}
+
+static void stall_backtrace_handler(int) {
+    const unsigned request = stall_requested.load();
+    unsigned claimed = stall_claimed.load();
+    if (claimed == request || !stall_claimed.compare_exchange_strong(claimed, request))
+        return;
+    stall_frame_count = backtrace(stall_frames, stall_max_frames);
+    stall_answered.store(request);
+}
+
+static std::string main_thread_backtrace() {
+    const unsigned request = stall_requested.load() + 1;
+    stall_requested.store(request);
+    pthread_kill(watchdog.main_thread, SIGRTMIN);
+    for (int i = 0; i < 100 && stall_answered.load() != request; i++)
+        g_usleep(G_TIME_SPAN_MILLISECOND);
+
+    if (stall_answered.load() != request) {
+        unsigned claimed = stall_claimed.load();
+        if (claimed != request && stall_claimed.compare_exchange_strong(claimed, request))
+            return {}; // the handler didn't run, and now won't for this request
+        // the handler claimed it in the meantime and is about to finish
+        while (stall_answered.load() != request)
+            g_usleep(G_TIME_SPAN_MILLISECOND);
+    }
+
+    const int count = stall_frame_count;
+    if (count <= 0)
+        return {};
+    std::string result;
+    char **symbols = backtrace_symbols(stall_frames, count);
+    for (int i = 0; symbols && i < count; i++) {
+        result += "\n    ";
+        result += symbols[i];
+    }
+    free(symbols);
+    return result;
+}
+
+static void log_stall(stall_record &record) {
+    size_t bucket = 0;
+    const gint64 duration_ms = record.duration_us / G_TIME_SPAN_MILLISECOND;
+    while (bucket < G_N_ELEMENTS(stall_buckets_ms) - 1 && duration_ms >= stall_buckets_ms[bucket])
+        bucket++;
+
+    g_mutex_lock(&watchdog.lock);
+    watchdog.histogram[bucket]++;
+    std::swap(watchdog.log[watchdog.recorded++ % stall_log_size], record);
+    g_mutex_unlock(&watchdog.lock);
+}
+
+static gpointer watchdog_thread(gpointer) {
+    gint64 stalled_beat = 0;
+    stall_record record;
+    for (;;) {
+        const gint64 threshold = watchdog.threshold_us.load();
+        g_usleep(threshold ? (gulong)heartbeat_interval(threshold) : G_USEC_PER_SEC);
+        if (!threshold) {
+            stalled_beat = 0;
+            continue;
+        }
+
+        const gint64 beat = watchdog.beat.load();
+        if (!stalled_beat) {
+            if (g_get_monotonic_time() - beat > threshold) {
+                const char *phase = current_phase.load(std::memory_order_relaxed);
+                record = stall_record{g_get_real_time(), 0, phase ? phase : "main loop",
+                                      watchdog.backtrace.load() ? main_thread_backtrace() : ""};
+                stalled_beat = beat;
+            }
+        } else if (beat != stalled_beat) {
+            record.duration_us = beat - stalled_beat - heartbeat_interval(threshold);
+            log_stall(record);
+            stalled_beat = 0;
+        }
+    }
+    return nullptr;
+}
+
+/*
+ * Clipboard contents arrive, and are fed to the child on paste, from GDK selection events rather
+ * than termise callbacks, so those are tagged as they are dispatched. Large transfers end with
+ * property notify events.
+ */
+static void phase_event_handler(GdkEvent *event, gpointer) {
+    const char *name = nullptr;
+    switch (event->type) {
+        case GDK_SELECTION_NOTIFY:
+            name = "paste";
+            break;
+        case GDK_PROPERTY_NOTIFY:
+            name = "property notify";
+            break;
+        case GDK_SELECTION_REQUEST:
+            name = "copy";
+            break;
+        default:
+            gtk_main_do_event(event);
+            return;
+    }
+    phase_scope phase(name);
+    gtk_main_do_event(event);
+}
+
+static gboolean heartbeat_cb(gpointer) {
+    watchdog.beat.store(g_get_monotonic_time());
+    return G_SOURCE_CONTINUE;
+}
+
+void watch_stalls(const config_info &config) {
+    const gint64 threshold = (gint64)config.stall_threshold * G_TIME_SPAN_MILLISECOND;
+    watchdog.backtrace.store(config.stall_backtrace);
+    if (config.stall_backtrace && !watchdog.handler_installed) {
+        // the first backtrace() call loads libgcc, which isn't safe from a signal handler
+        void *frame;
+        backtrace(&frame, 1);
+        struct sigaction action = {};
+        action.sa_handler = stall_backtrace_handler;
+        action.sa_flags = SA_RESTART;
+        sigaction(SIGRTMIN, &action, nullptr);
+        watchdog.handler_installed = true;
+    }
+
+    if (threshold == watchdog.threshold_us.load())
+        return;
+    if (watchdog.heartbeat) {
+        g_source_remove(watchdog.heartbeat);
+        watchdog.heartbeat = 0;
+    }
+    watchdog.beat.store(g_get_monotonic_time());
+    watchdog.threshold_us.store(threshold);
+    if (!threshold)
+        return;
+
+    watchdog.heartbeat = g_timeout_add_full(G_PRIORITY_HIGH,
+                                            (guint)(heartbeat_interval(threshold) /
+                                                    G_TIME_SPAN_MILLISECOND),
+                                            heartbeat_cb, nullptr, nullptr);
+    if (!watchdog.thread) {
+        gdk_event_handler_set(phase_event_handler, nullptr, nullptr);
+        watchdog.main_thread = pthread_self();
+        watchdog.thread = g_thread_new("termise-watchdog", watchdog_thread, nullptr);
+    }
+}
+
+static void dump_stalls() {
+    g_mutex_lock(&watchdog.lock);
+    std::string histogram;
+    for (size_t i = 0; i < G_N_ELEMENTS(stall_buckets_ms); i++) {
+        char bucket[64];
+        if (stall_buckets_ms[i] == G_MAXINT64) {
+            snprintf(bucket, sizeof bucket, ", >= %" G_GINT64_FORMAT " ms: %" G_GUINT64_FORMAT,
+                     stall_buckets_ms[i - 1], watchdog.histogram[i]);
+        } else {
+            snprintf(bucket, sizeof bucket, ", < %" G_GINT64_FORMAT " ms: %" G_GUINT64_FORMAT,
+                     stall_buckets_ms[i], watchdog.histogram[i]);
+        }
+        histogram += bucket;
+    }
+    g_printerr("stalls: %" G_GUINT64_FORMAT " recorded%s\n", watchdog.recorded, histogram.c_str());
+
+    const uint64_t first = watchdog.recorded > stall_log_size
+                           ? watchdog.recorded - stall_log_size : 0;
+    for (uint64_t i = first; i < watchdog.recorded; i++) {
+        const stall_record &record = watchdog.log[i % stall_log_size];
+        GDateTime *time = g_date_time_new_from_unix_local(record.time / G_USEC_PER_SEC);
+        char *when = g_date_time_format(time, "%F %T");
+        g_printerr("stall at %s: %" G_GINT64_FORMAT " ms in %s%s\n", when,
+                   record.duration_us / G_TIME_SPAN_MILLISECOND, record.phase,
+                   record.backtrace.c_str());
+        g_free(when);
+        g_date_time_unref(time);
+    }
+    g_mutex_unlock(&watchdog.lock);
+}
+/* }}} */
+
+static gboolean dump_stats(gpointer) {
+    const double busy = double(trigger_stats.busy_us.load()) / G_USEC_PER_SEC;
+    g_printerr("triggers: %" G_GUINT64_FORMAT " scans, %" G_GUINT64_FORMAT " bytes, %"
+               G_GUINT64_FORMAT " matches, %" G_GUINT64_FORMAT " suppressed, %" G_GUINT64_FORMAT
+               " rows trimmed before scanning, %.1f MiB/s\n",
+               trigger_stats.scans.load(), trigger_stats.bytes.load(),
+               trigger_stats.matches.load(), trigger_stats.suppressed.load(),
+               trigger_stats.rows_skipped.load(),
+               busy > 0 ? double(trigger_stats.bytes.load()) / busy / (1 << 20) : 0.0);
+    g_printerr("keys: %" G_GUINT64_FORMAT " presses, %" G_GUINT64_FORMAT " bound, %.3f us/lookup\n",
+               key_stats.presses, key_stats.bound,
+               key_stats.presses ? double(key_stats.lookup_us) / double(key_stats.presses) : 0.0);
+    g_printerr("resize: %" G_GUINT64_FORMAT " grid changes, %" G_GUINT64_FORMAT " deferred\n",
+               resize_stats.requested, resize_stats.deferred);
+    for (size_t i = 0; i < G_N_ELEMENTS(resize_buckets); i++) {
+        if (!resize_stats.applied[i])
+            continue;
+        const bool last = resize_buckets[i] == G_MAXLONG;
+        g_printerr("resize with %s %ld scrollback rows: %" G_GUINT64_FORMAT " applied, "
+                   "%.0f us avg, %" G_GUINT64_FORMAT " us max\n", last ? ">=" : "<",
+                   resize_buckets[last ? i - 1 : i], resize_stats.applied[i],
+                   double(resize_stats.total_us[i]) / double(resize_stats.applied[i]),
+                   resize_stats.max_us[i]);
+    }
+    dump_stalls();
+    const auto &u = window_updates;
+    for (const auto &w : {std::make_pair("title", u.title_stats),
+                          std::make_pair("urgency", u.urgency_stats),
+                          std::make_pair("size hints", u.hints_stats)}) {
+        g_printerr("window %s: %" G_GUINT64_FORMAT " requested, %" G_GUINT64_FORMAT
+                   " coalesced, %" G_GUINT64_FORMAT " unchanged, %" G_GUINT64_FORMAT " written\n",
+                   w.first, w.second.requested, w.second.coalesced, w.second.unchanged,
+                   w.second.written);
+    }
+    return G_SOURCE_CONTINUE;
+}
+
 int main(int argc, char **argv) {
+    start_spawn_helper();
+
     GError *error = nullptr;
     const char *const term = "xterm-termise";
     char *directory = nullptr;
@@ -558,9 +3036,7 @@ int main(int argc, char **argv) {
     }
 
     GtkWidget *window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
-
-    GtkWidget *vte_widget = vte_terminal_new();
-    VteTerminal *vte = VTE_TERMINAL(vte_widget);
+    GtkWidget *notebook = gtk_notebook_new();
 
     if (role) {
         gtk_window_set_role(GTK_WINDOW(window), role);
@@ -568,7 +3044,7 @@ int main(int argc, char **argv) {
     }
 
     char **command_argv;
-    char *default_argv[2] = {nullptr, nullptr};
+    char *default_argv[2] = {get_user_shell_with_fallback(), nullptr};
 
     if (execute) {
         int argcp;
@@ -580,36 +3056,53 @@ int main(int argc, char **argv) {
         }
         command_argv = argvp;
     } else {
-        default_argv[0] = get_user_shell_with_fallback();
         command_argv = default_argv;
     }
 
     keybind_info info {
-        GTK_WINDOW(window), vte,
-        {FALSE, FALSE, FALSE, FALSE, FALSE, config_file, 0, {}, 0},
-        gtk_window_fullscreen
+        GTK_WINDOW(window), GTK_NOTEBOOK(notebook), nullptr,
+        {FALSE, FALSE, FALSE, FALSE, FALSE, config_file, 0, {}, 0, {}, compile_keys(nullptr, FALSE),
+         {}, {}, 0, {}, default_resize_interval, 0, FALSE},
+        gtk_window_fullscreen, hold, title != nullptr, default_argv[0], nullptr
     };
 
-    load_config(GTK_WINDOW(window), vte, &info.config, geometry ? nullptr : &geometry,
-                icon ? nullptr : &icon);
+    GdkRGBA transparent {0, 0, 0, 0};
+    transparent_provider = gtk_css_provider_new();
+    load_background_color(transparent_provider, &transparent);
+    add_css_provider(notebook, transparent_provider);
+
+    load_config(&info.config, geometry ? nullptr : &geometry, icon ? nullptr : &icon);
+    apply_window_theme(&info);
+    watch_stalls(info.config);
 
     reload_config = [&]{
-        load_config(GTK_WINDOW(window), vte, &info.config, nullptr, nullptr);
+        phase_scope phase("reload config");
+        load_config(&info.config, nullptr, nullptr);
+        apply_config(&info);
     };
     signal(SIGUSR1, [](int){ reload_config(); });
+    g_unix_signal_add(SIGUSR2, dump_stats, nullptr);
+    g_signal_override_class_handler("size-allocate", VTE_TYPE_TERMINAL,
+                                    G_CALLBACK(terminal_size_allocate));
 
-    GdkRGBA transparent {0, 0, 0, 0};
+    gtk_notebook_set_show_border(GTK_NOTEBOOK(notebook), FALSE);
+    gtk_notebook_set_show_tabs(GTK_NOTEBOOK(notebook), FALSE);
+    gtk_notebook_set_scrollable(GTK_NOTEBOOK(notebook), TRUE);
+    gtk_container_add(GTK_CONTAINER(window), notebook);
 
-    override_background_color(vte_widget, &transparent);
+    VteTerminal *vte = new_terminal(&info);
+    gtk_notebook_append_page(GTK_NOTEBOOK(notebook), GTK_WIDGET(vte), nullptr);
+    info.vte = vte;
 
-    gtk_container_add(GTK_CONTAINER(window), vte_widget);
+    g_signal_connect(notebook, "page-added", G_CALLBACK(update_tabs_cb), &info);
+    g_signal_connect(notebook, "page-removed", G_CALLBACK(update_tabs_cb), &info);
+    g_signal_connect(notebook, "switch-page", G_CALLBACK(switch_page_cb), &info);
 
-    if (!hold) {
-        g_signal_connect(vte, "child-exited", G_CALLBACK(exit_with_status), nullptr);
-    }
     g_signal_connect(window, "destroy", G_CALLBACK(exit_with_success), nullptr);
-    g_signal_connect(vte, "key-press-event", G_CALLBACK(key_press_cb), &info);
-    g_signal_connect(vte, "bell", G_CALLBACK(bell_cb), &info.config.urgent_on_bell);
+    if (helper_fd != -1) {
+        helper_source = g_unix_fd_add(helper_fd, (GIOCondition)(G_IO_IN | G_IO_HUP | G_IO_ERR),
+                                      helper_cb, nullptr);
+    }
 
     g_signal_connect(window, "focus-in-event",  G_CALLBACK(focus_cb), nullptr);
     g_signal_connect(window, "focus-out-event", G_CALLBACK(focus_cb), nullptr);
@@ -626,11 +3119,13 @@ int main(int argc, char **argv) {
         gtk_window_set_title(GTK_WINDOW(window), title);
         g_free(title);
     } else {
-        g_signal_connect(vte, "window-title-changed", G_CALLBACK(window_title_cb),
-                         &info.config.dynamic_title);
-        window_title_cb(vte, &info.config.dynamic_title);
+        window_title_cb(vte, &info);
     }
 
+    update_size_hints(&info);
+    // the geometry is parsed in cells only once the hints are set
+    flush_window_updates();
+
     if (geometry) {
         if (!gtk_window_parse_geometry(GTK_WINDOW(window), geometry)) {
             g_printerr("invalid geometry string: %s\n", geometry);
@@ -643,7 +3138,7 @@ int main(int argc, char **argv) {
         g_free(icon);
     }
 
-    gtk_widget_grab_focus(vte_widget);
+    gtk_widget_grab_focus(GTK_WIDGET(vte));
     gtk_widget_show_all(window);
 
     char **env = g_get_environ();
@@ -663,12 +3158,9 @@ int main(int argc, char **argv) {
 
     env = g_environ_setenv(env, "TERM", term, TRUE);
 
-    GPid child_pid;
-    if (vte_terminal_spawn_sync(vte, VTE_PTY_DEFAULT, nullptr, command_argv, env,
-                                G_SPAWN_SEARCH_PATH, nullptr, nullptr, &child_pid, nullptr,
-                                &error)) {
-        vte_terminal_watch_child(vte, child_pid);
-    } else {
+    info.env = env;
+
+    if (!spawn_child(vte, nullptr, command_argv, env, &error)) {
         g_printerr("the command failed to run: %s\n", error->message);
         return EXIT_FAILURE;
     }
@@ -683,8 +3175,6 @@ int main(int argc, char **argv) {
                           (width - padding_left - padding_right) / char_width,
                           (height - padding_top - padding_bottom) / char_height);
 
-    g_strfreev(env);
-
     gtk_main();
     return EXIT_FAILURE; // child process did not cause termination
 }